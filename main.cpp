@@ -1,212 +1,5388 @@
 #include "raylib.h"
 #include "raymath.h"
+#include "rlgl.h"
 #include <vector>
 #include <cmath>
+#include <algorithm>
+#include <atomic>
+#include <cfloat>
+#include <chrono>
+#include <climits>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <sstream>
+#include <string>
+#include <thread>
 
-// Screen dimensions
-const int screenWidth = 1200;
-const int screenHeight = 800;
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define FLOCK_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#elif defined(__ARM_NEON)
+#define FLOCK_NEON 1
+#include <arm_neon.h>
+#endif
 
-// Number of boids and parameters for their behavior
-const int NUM_BOIDS = 1000;
-const float MAX_SPEED = 2.5f;            // Maximum speed of each boid
-const float MAX_FORCE = 0.1f;            // Maximum force applied to a boid
-const float NEIGHBOR_RADIUS = 100.0f;    // Radius to consider for neighbors (for alignment and cohesion)
-const float SEPARATION_RADIUS = 20.0f;   // Radius to consider for separation behavior
-const float COHESION_WEIGHT = 0.5f;      // Weight for the cohesion behavior
-const float ALIGNMENT_WEIGHT = 0.1f;     // Weight for the alignment behavior
-const float SEPARATION_WEIGHT = 0.2f;    // Weight for the separation behavior
+// Memory-mapped files for replay. windows.h is trimmed so it doesn't clash with raylib's names.
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOGDI
+#define NOUSER
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Lets a single function use instructions beyond the compiler's baseline (GCC/Clang; MSVC needs nothing)
+#if defined(__GNUC__) || defined(__clang__)
+#define FLOCK_TARGET(isa) __attribute__((target(isa)))
+#else
+#define FLOCK_TARGET(isa)
+#endif
+
+// Per-phase timers are on in debug builds and in builds with -DFLOCK_PROFILE, and
+// compile to nothing otherwise. -DFLOCK_TRACY also reports them as Tracy zones.
+#if !defined(NDEBUG) || defined(FLOCK_PROFILE)
+#define FLOCK_PROFILING 1
+#endif
+#if defined(FLOCK_TRACY)
+#include <tracy/Tracy.hpp>
+#endif
+
+// -DFLOCK_MPI builds the distributed mode (--distributed) on MPI, one tile per rank
+#if defined(FLOCK_MPI)
+#include <mpi.h>
+#endif
+
+// Simulation parameters. The defaults below can be overridden from an INI or
+// JSON config file and from the command line, and most of them can be edited
+// live in the window.
+struct SimConfig {
+    // Screen dimensions (the size of the world)
+    int screenWidth = 1200;
+    int screenHeight = 800;
+    int windowWidth = 0;                 // Size of the window looking at the world (0 = the world's size)
+    int windowHeight = 0;
+    float heatmapZoom = 0.25f;           // Zoomed out further, the window shows boid density instead of boids
+
+    // Number of boids and parameters for their behavior
+    int numBoids = 1000;
+    float maxSpeed = 2.5f;               // Maximum speed of each boid
+    float maxForce = 0.1f;               // Maximum force applied to a boid
+    float neighborRadius = 100.0f;       // Radius to consider for neighbors (for alignment and cohesion)
+    float separationRadius = 20.0f;      // Radius to consider for separation behavior
+    float cohesionWeight = 0.5f;         // Weight for the cohesion behavior
+    float alignmentWeight = 0.1f;        // Weight for the alignment behavior
+    float separationWeight = 0.2f;       // Weight for the separation behavior
+
+    // Threading parameters for the simulation step
+    int numThreads = 0;                  // Number of simulation threads (0 = one per hardware thread)
+    int chunkSize = 256;                 // Number of boids handed to a thread at a time
+    int boidCapacity = 65536;            // Boids storage is preallocated for (grows by doubling past it)
+    int gridSubdivision = 1;             // Grid cells per neighbor radius (the block searched is (2s+1)^2 cells)
+    int cellAggregates = 0;              // 1 = take cells entirely inside the neighbor radius from their sums
+    int maxNeighborsPerCell = 0;         // Neighbors sampled from each grid cell (0 = all of them)
+    int reorderInterval = 16;            // Steps between re-sorting boid storage into grid cell order (0 = never)
+    float verletSkin = 0.0f;             // Margin of the cached per-boid neighbor lists (0 = search the grid every step)
+    int fastMath = 0;                    // 1 = approximate square roots in the steering code (see FastMath)
+    int compactNeighbors = 0;            // 1 = keep the grid's neighbor data as 16-bit fixed point (half the bytes)
+    int lodInterval = 1;                 // Most steps a boid may coast between full updates (1 = update every boid every step)
+    float lodError = 0.05f;              // Velocity error a coasting boid may build up, in pixels per step
+    int balanceInterval = 8;             // Steps between load balancing checks (0 = plain chunks of chunk_size)
+    float balanceTolerance = 0.1f;       // Imbalance (slowest share over its target, minus 1) left alone
+
+    // Timing: the simulation runs at a fixed rate, independent of the render rate
+    float simRate = 60.0f;               // Simulation steps per second
+    int maxStepsPerFrame = 8;            // Simulation steps a slow frame may catch up on before time is dropped
+    int targetFps = 60;                  // Render frame rate cap (0 = uncapped)
+
+    // Seed of the random initial flock and of spawned boids (0 = a new seed every run)
+    int seed = 0;
+
+    // Speeds and forces are tuned per 1/60 s step; this scales them to the actual step length
+    float stepScale() const { return 60.0f / simRate; }
+
+    bool set(const std::string& key, const std::string& value);
+    bool loadFile(const char* path);
+    bool loadText(std::string text, const char* source);
+    std::string toText() const;
+
+    static constexpr double MAX_GRID_CELLS = 1 << 24;  // Largest spatial grid (keeps cols * rows + 1 well inside an int)
+
+    // Cells of the spatial grid these parameters build (see SpatialGrid)
+    double gridCells() const {
+        double cols = std::max(1.0, std::floor(screenWidth / (double)neighborRadius)) * gridSubdivision;
+        double rows = std::max(1.0, std::floor(screenHeight / (double)neighborRadius)) * gridSubdivision;
+        return cols * rows;
+    }
+
+    // Clamp the parameters to values the simulation can run with
+    void sanitize() {
+        screenWidth = std::max(screenWidth, 1);
+        screenHeight = std::max(screenHeight, 1);
+        windowWidth = std::max(windowWidth, 0);
+        windowHeight = std::max(windowHeight, 0);
+        heatmapZoom = std::max(heatmapZoom, 0.0f);
+        numBoids = std::max(numBoids, 0);
+        boidCapacity = std::max(boidCapacity, 1);
+        neighborRadius = std::max(neighborRadius, 1.0f);
+        gridSubdivision = std::min(std::max(gridSubdivision, 1), 8);
+        while (gridSubdivision > 1 && gridCells() > MAX_GRID_CELLS) gridSubdivision--;  // Too many cells: coarser grid first,
+        if (gridCells() > MAX_GRID_CELLS) {                                               // then a larger radius
+            neighborRadius = (float)std::sqrt((double)screenWidth * screenHeight / MAX_GRID_CELLS) * 1.001f;
+        }
+        separationRadius = std::min(std::max(separationRadius, 0.0f), neighborRadius);  // Neighbors are only gathered within neighborRadius
+        numThreads = std::max(numThreads, 0);
+        chunkSize = std::max(chunkSize, 1);
+        reorderInterval = std::max(reorderInterval, 0);
+        verletSkin = std::max(verletSkin, 0.0f);
+        fastMath = std::min(std::max(fastMath, 0), 1);
+        compactNeighbors = std::min(std::max(compactNeighbors, 0), 1);
+        balanceInterval = std::max(balanceInterval, 0);
+        lodInterval = std::min(std::max(lodInterval, 1), 64);
+        lodError = std::max(lodError, 0.0f);
+        balanceTolerance = std::max(balanceTolerance, 0.0f);
+        maxNeighborsPerCell = std::max(maxNeighborsPerCell, 0);
+        cellAggregates = std::min(std::max(cellAggregates, 0), 1);
+        simRate = std::max(simRate, 1.0f);
+        maxStepsPerFrame = std::max(maxStepsPerFrame, 1);
+        targetFps = std::max(targetFps, 0);
+        seed = std::max(seed, 0);
+    }
+};
+
+// Name and storage of each config parameter, used for parsing and for live editing
+struct ConfigField {
+    const char* key;
+    float SimConfig::* floatValue;  // Set for float parameters
+    int SimConfig::* intValue;      // Set for integer parameters
+    bool live;                      // Can be changed while the simulation runs
+};
+
+const ConfigField CONFIG_FIELDS[] = {
+    { "screen_width",      nullptr,                       &SimConfig::screenWidth, false },
+    { "screen_height",     nullptr,                       &SimConfig::screenHeight, false },
+    { "window_width",      nullptr,                       &SimConfig::windowWidth, false },
+    { "window_height",     nullptr,                       &SimConfig::windowHeight, false },
+    { "heatmap_zoom",      &SimConfig::heatmapZoom,       nullptr, true },
+    { "num_boids",         nullptr,                       &SimConfig::numBoids, true },
+    { "max_speed",         &SimConfig::maxSpeed,          nullptr, true },
+    { "max_force",         &SimConfig::maxForce,          nullptr, true },
+    { "neighbor_radius",   &SimConfig::neighborRadius,    nullptr, true },
+    { "separation_radius", &SimConfig::separationRadius,  nullptr, true },
+    { "cohesion_weight",   &SimConfig::cohesionWeight,    nullptr, true },
+    { "alignment_weight",  &SimConfig::alignmentWeight,   nullptr, true },
+    { "separation_weight", &SimConfig::separationWeight,  nullptr, true },
+    { "num_threads",       nullptr,                       &SimConfig::numThreads, true },
+    { "chunk_size",        nullptr,                       &SimConfig::chunkSize, true },
+    { "boid_capacity",     nullptr,                       &SimConfig::boidCapacity, false },
+    { "grid_subdivision",  nullptr,                       &SimConfig::gridSubdivision, true },
+    { "cell_aggregates",   nullptr,                       &SimConfig::cellAggregates, true },
+    { "max_neighbors_per_cell", nullptr,                  &SimConfig::maxNeighborsPerCell, true },
+    { "reorder_interval",  nullptr,                       &SimConfig::reorderInterval, true },
+    { "verlet_skin",       &SimConfig::verletSkin,        nullptr, true },
+    { "fast_math",         nullptr,                       &SimConfig::fastMath, true },
+    { "compact_neighbors", nullptr,                       &SimConfig::compactNeighbors, true },
+    { "balance_interval",  nullptr,                       &SimConfig::balanceInterval, true },
+    { "lod_interval",      nullptr,                       &SimConfig::lodInterval, true },
+    { "lod_error",         &SimConfig::lodError,          nullptr, true },
+    { "balance_tolerance", &SimConfig::balanceTolerance,  nullptr, true },
+    { "sim_rate",          &SimConfig::simRate,           nullptr, true },
+    { "max_steps_per_frame", nullptr,                     &SimConfig::maxStepsPerFrame, true },
+    { "target_fps",        nullptr,                       &SimConfig::targetFps, true },
+    { "seed",              nullptr,                       &SimConfig::seed, false },
+};
+
+// Set the parameter called key from its text value, returns false if either is invalid
+bool SimConfig::set(const std::string& key, const std::string& value) {
+    for (const ConfigField& field : CONFIG_FIELDS) {
+        if (key != field.key) continue;
+        char* end;
+        double number = strtod(value.c_str(), &end);
+        if (end == value.c_str() || !std::isfinite(number)) return false;  // Not a number
+        if (field.floatValue) {
+            if (std::fabs(number) > FLT_MAX) return false;  // Out of the float range
+            this->*field.floatValue = (float)number;
+        } else {
+            if (number < INT_MIN || number > INT_MAX) return false;  // Out of the int range
+            this->*field.intValue = (int)number;
+        }
+        return true;
+    }
+    return false;
+}
+
+// Load parameters from a file, either flat JSON ({ "max_speed": 3.0, ... }) or
+// INI (max_speed = 3.0, one per line; sections and ;/# comments are ignored)
+bool SimConfig::loadFile(const char* path) {
+    std::ifstream file(path);
+    if (!file) {
+        TraceLog(LOG_WARNING, "FLOCK: Failed to open config file %s", path);
+        return false;
+    }
+    std::stringstream buffer;
+    buffer << file.rdbuf();
+    return loadText(buffer.str(), path);
+}
+
+// Load parameters from the text of a config file; source names it in warnings
+bool SimConfig::loadText(std::string text, const char* source) {
+    // Both formats boil down to key/value pairs: turn JSON punctuation into line breaks and spaces
+    size_t first = text.find_first_not_of(" \t\r\n");
+    if (first != std::string::npos && text[first] == '{') {
+        for (char& c : text) {
+            if (c == ',' || c == '{' || c == '}') c = '\n';
+            else if (c == '"') c = ' ';
+            else if (c == ':') c = '=';
+        }
+    }
+
+    bool ok = true;
+    std::istringstream lines(text);
+    std::string line;
+    while (std::getline(lines, line)) {
+        size_t start = line.find_first_not_of(" \t\r");
+        if (start == std::string::npos || line[start] == ';' || line[start] == '#' || line[start] == '[') continue;
+        size_t equals = line.find('=');
+        if (equals == std::string::npos) continue;
+
+        auto trim = [](std::string v) {
+            size_t first = v.find_first_not_of(" \t\r");
+            size_t last = v.find_last_not_of(" \t\r");
+            return first == std::string::npos ? std::string() : v.substr(first, last - first + 1);
+        };
+        std::string key = trim(line.substr(0, equals));
+        std::string value = trim(line.substr(equals + 1));
+        if (!set(key, value)) {
+            TraceLog(LOG_WARNING, "FLOCK: Ignoring config entry '%s = %s' in %s", key.c_str(), value.c_str(), source);
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+// All parameters in INI form, readable by loadText
+std::string SimConfig::toText() const {
+    std::string text;
+    for (const ConfigField& field : CONFIG_FIELDS) {
+        if (field.floatValue) text += TextFormat("%s = %.9g\n", field.key, this->*field.floatValue);
+        else text += TextFormat("%s = %d\n", field.key, this->*field.intValue);
+    }
+    return text;
+}
+
+// Phases of a frame that are timed separately
+enum ProfilePhase {
+    PHASE_GRID,       // Spatial index build (and storage re-sort)
+    PHASE_FORCES,     // Neighbor search and steering forces
+    PHASE_INTEGRATE,  // Boid::update
+    PHASE_BORDERS,    // Boid::borders
+    PHASE_DRAW,       // Issuing the draw calls
+    PHASE_PRESENT,    // EndDrawing: buffer swap and frame rate wait
+    PHASE_COUNT
+};
+
+const char* const PHASE_NAMES[PHASE_COUNT] = { "grid build", "forces", "integrate", "borders", "draw", "present" };
+
+// Collects the time spent in each phase. Times from several threads add up, so a
+// parallel phase shows its CPU time. The last HISTORY frames are kept per phase,
+// and with tracing on every timed scope is also kept as a Chrome trace event.
+struct Profiler {
+    static constexpr int HISTORY = 240;
+
+    struct TraceEvent {
+        int phase;
+        uint32_t thread;
+        double start, duration;  // Microseconds since the profiler started
+    };
+
+    std::atomic<uint64_t> frameNanos[PHASE_COUNT];  // Time spent in each phase during the current frame
+    float history[PHASE_COUNT][HISTORY] = {};       // Milliseconds per phase for the last frames (ring buffer)
+    int historyPos = 0;                             // Slot of the next frame in history
+    int historyCount = 0;                           // Number of valid frames in history
+    bool tracing = false;                           // Record trace events (set before any timing starts)
+    std::mutex traceMutex;                          // Guards events
+    std::vector<TraceEvent> events;
+    std::chrono::steady_clock::time_point origin = std::chrono::steady_clock::now();
+
+    Profiler() {
+        for (auto& nanos : frameNanos) nanos.store(0);
+    }
+
+    // Small sequential id of the calling thread, for trace events
+    static uint32_t threadId() {
+        static std::atomic<uint32_t> nextId{ 0 };
+        thread_local uint32_t id = nextId++;
+        return id;
+    }
+
+    void record(int phase, std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end) {
+        frameNanos[phase].fetch_add((uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count(), std::memory_order_relaxed);
+        if (tracing) {
+            std::lock_guard<std::mutex> lock(traceMutex);
+            events.push_back({ phase, threadId(),
+                               std::chrono::duration<double, std::micro>(start - origin).count(),
+                               std::chrono::duration<double, std::micro>(end - start).count() });
+        }
+    }
+
+    // Close the current frame: move its phase times into the history
+    void endFrame() {
+        for (int p = 0; p < PHASE_COUNT; p++) {
+            history[p][historyPos] = frameNanos[p].exchange(0, std::memory_order_relaxed) * 1e-6f;
+        }
+        historyPos = (historyPos + 1) % HISTORY;
+        historyCount = std::min(historyCount + 1, HISTORY);
+    }
+
+    // Time of a phase at quantile q (0..1) over the kept frames, in milliseconds
+    float percentile(int phase, float q) const {
+        if (historyCount == 0) return 0.0f;
+        std::vector<float> sorted(history[phase], history[phase] + historyCount);
+        size_t k = std::min(sorted.size() - 1, (size_t)(q * sorted.size()));
+        std::nth_element(sorted.begin(), sorted.begin() + k, sorted.end());
+        return sorted[k];
+    }
+
+    // Write the recorded events as Chrome trace JSON (chrome://tracing, Perfetto)
+    bool writeTrace(const char* path) {
+        FILE* file = fopen(path, "w");
+        if (!file) return false;
+        std::lock_guard<std::mutex> lock(traceMutex);
+        fprintf(file, "{\"traceEvents\":[\n");
+        for (size_t e = 0; e < events.size(); e++) {
+            const TraceEvent& event = events[e];
+            fprintf(file, "{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%u}%s\n",
+                    PHASE_NAMES[event.phase], event.start, event.duration, event.thread, e + 1 < events.size() ? "," : "");
+        }
+        fprintf(file, "]}\n");
+        return fclose(file) == 0;
+    }
+
+    // Overlay with the times of every phase and a bar per kept frame
+    void draw(int x, int y) const {
+#if defined(FLOCK_PROFILING)
+        DrawRectangle(x, y, 520, 24 + PHASE_COUNT * 22, Fade(RAYWHITE, 0.85f));
+        DrawText("phase          last    p50    p99 ms", x + 8, y + 4, 16, DARKGRAY);
+        for (int p = 0; p < PHASE_COUNT; p++) {
+            int rowY = y + 24 + p * 22;
+            int last = (historyPos + HISTORY - 1) % HISTORY;
+            DrawText(TextFormat("%-12s %6.2f %6.2f %6.2f", PHASE_NAMES[p], history[p][last], percentile(p, 0.5f), percentile(p, 0.99f)), x + 8, rowY, 16, DARKGRAY);
+
+            // Bars scaled to the slowest kept frame of the phase, oldest on the left
+            float peak = 1e-3f;
+            for (int f = 0; f < historyCount; f++) peak = std::max(peak, history[p][f]);
+            for (int f = 0; f < historyCount; f++) {
+                float value = history[p][(historyPos + HISTORY - historyCount + f) % HISTORY];
+                int height = (int)(18 * value / peak);
+                DrawRectangle(x + 276 + f, rowY + 18 - height, 1, height, MAROON);
+            }
+        }
+#else
+        DrawText("Profiling is compiled out (build with -DFLOCK_PROFILE)", x + 8, y + 4, 16, DARKGRAY);
+#endif
+    }
+};
+
+// The process-wide profiler
+inline Profiler& profiler() {
+    static Profiler instance;
+    return instance;
+}
+
+// Times the enclosing block as one phase
+struct ProfileScope {
+    int phase;
+    std::chrono::steady_clock::time_point start;
+
+    ProfileScope(int phase) : phase(phase), start(std::chrono::steady_clock::now()) {}
+    ~ProfileScope() { profiler().record(phase, start, std::chrono::steady_clock::now()); }
+};
+
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+#if defined(FLOCK_PROFILING) && defined(FLOCK_TRACY)
+#define PROFILE_SCOPE(phase) ProfileScope PROFILE_CONCAT(profileScope, __LINE__)(phase); ZoneScopedN(#phase)
+#define PROFILE_FRAME() profiler().endFrame(); FrameMark
+#elif defined(FLOCK_PROFILING)
+#define PROFILE_SCOPE(phase) ProfileScope PROFILE_CONCAT(profileScope, __LINE__)(phase)
+#define PROFILE_FRAME() profiler().endFrame()
+#else
+#define PROFILE_SCOPE(phase)
+#define PROFILE_FRAME()
+#endif
+
+// Fixed set of worker threads that run parallel loops. A loop is cut into chunks
+// that are dealt round-robin to one queue per thread; a thread that empties its
+// own queue steals chunks from the others, so a crowded part of the flock doesn't
+// leave the rest of the cores idle.
+struct ThreadPool {
+    struct WorkQueue {
+        std::mutex mutex;
+        std::deque<std::pair<size_t, size_t>> chunks;  // [begin, end) ranges waiting to run
+    };
+
+    std::vector<std::thread> workers;                  // Worker threads (the calling thread is thread 0)
+    std::vector<std::unique_ptr<WorkQueue>> queues;    // One queue per thread, including the caller
+    std::function<void(size_t, size_t)> job;           // Body of the loop being run
+    std::atomic<size_t> remaining{ 0 };                // Chunks of the current loop not finished yet
+    std::mutex mutex;                                  // Guards generation/stopping and the condition variables
+    std::condition_variable wake;                      // Signals the workers that a loop started
+    std::condition_variable done;                      // Signals the caller that the loop finished
+    unsigned long long generation = 0;                 // Incremented for every loop
+    bool stopping = false;
+
+    // Constructor to start the workers (threadCount includes the calling thread, 0 = hardware threads)
+    ThreadPool(int threadCount) {
+        if (threadCount <= 0) threadCount = std::max(1, (int)std::thread::hardware_concurrency());
+        for (int i = 0; i < threadCount; i++) {
+            queues.push_back(std::make_unique<WorkQueue>());
+        }
+        for (int i = 1; i < threadCount; i++) {
+            workers.emplace_back([this, i] { workerLoop(i); });
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& worker : workers) worker.join();
+    }
+
+    int threadCount() const { return (int)queues.size(); }
+
+    // Run body(chunkBegin, chunkEnd) over [begin, end) in chunks of chunkSize, and wait for all of them
+    void parallelFor(size_t begin, size_t end, size_t chunkSize, std::function<void(size_t, size_t)> body) {
+        chunkSize = std::max<size_t>(chunkSize, 1);
+        if (workers.empty() || end - begin <= chunkSize) {
+            if (begin < end) body(begin, end);  // Not worth waking the workers
+            return;
+        }
+
+        job = std::move(body);
+        size_t chunkCount = (end - begin + chunkSize - 1) / chunkSize;
+        remaining = chunkCount;
+        for (size_t c = 0; c < chunkCount; c++) {
+            size_t chunkBegin = begin + c * chunkSize;
+            WorkQueue& queue = *queues[c % queues.size()];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            queue.chunks.emplace_back(chunkBegin, std::min(chunkBegin + chunkSize, end));
+        }
+        runLoop();
+    }
+
+    // Run body over every range [bounds[k], bounds[k + 1]) as one chunk, and wait for all of them
+    void parallelForRanges(const std::vector<size_t>& bounds, std::function<void(size_t, size_t)> body) {
+        if (bounds.size() < 2) return;
+        if (workers.empty() || bounds.size() == 2) {
+            for (size_t c = 0; c + 1 < bounds.size(); c++) body(bounds[c], bounds[c + 1]);
+            return;
+        }
+
+        job = std::move(body);
+        remaining = bounds.size() - 1;
+        for (size_t c = 0; c + 1 < bounds.size(); c++) {
+            WorkQueue& queue = *queues[c % queues.size()];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            queue.chunks.emplace_back(bounds[c], bounds[c + 1]);
+        }
+        runLoop();
+    }
+
+    // Wake the workers for the queued chunks and wait until they are all done
+    void runLoop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            generation++;
+        }
+        wake.notify_all();
+
+        runChunks(0);  // The caller works too
+
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [this] { return remaining == 0; });
+    }
+
+    // Take a chunk from our own queue, or steal the oldest chunk of another thread
+    bool takeChunk(int self, std::pair<size_t, size_t>& chunk) {
+        for (size_t k = 0; k < queues.size(); k++) {
+            WorkQueue& queue = *queues[(self + k) % queues.size()];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (queue.chunks.empty()) continue;
+            if (k == 0) {
+                chunk = queue.chunks.back();   // Own queue: newest first
+                queue.chunks.pop_back();
+            } else {
+                chunk = queue.chunks.front();  // Victim's queue: oldest first
+                queue.chunks.pop_front();
+            }
+            return true;
+        }
+        return false;
+    }
+
+    // Run chunks until every queue is empty
+    void runChunks(int self) {
+        std::pair<size_t, size_t> chunk;
+        while (takeChunk(self, chunk)) {
+            job(chunk.first, chunk.second);
+            if (remaining.fetch_sub(1) == 1) {
+                std::lock_guard<std::mutex> lock(mutex);
+                done.notify_all();  // Last chunk of the loop
+            }
+        }
+    }
+
+    void workerLoop(int self) {
+        unsigned long long seen = 0;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [&] { return stopping || generation != seen; });
+                if (stopping) return;
+                seen = generation;
+            }
+            runChunks(self);
+        }
+    }
+};
+
+// Allocator for arrays that start on a cache line, so SIMD code can use aligned loads
+template <typename T, size_t Alignment = 64>
+struct AlignedAllocator {
+    typedef T value_type;
+    template <typename U> struct rebind { typedef AlignedAllocator<U, Alignment> other; };
+
+    AlignedAllocator() = default;
+    template <typename U> AlignedAllocator(const AlignedAllocator<U, Alignment>&) {}
+
+    T* allocate(size_t n) { return static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t(Alignment))); }
+    void deallocate(T* p, size_t) { ::operator delete(p, std::align_val_t(Alignment)); }
+
+    template <typename U> bool operator==(const AlignedAllocator<U, Alignment>&) const { return true; }
+    template <typename U> bool operator!=(const AlignedAllocator<U, Alignment>&) const { return false; }
+};
+
+template <typename T>
+using AlignedVector = std::vector<T, AlignedAllocator<T>>;
+
+struct Boid;
+struct BoidSoA;
+
+// Thin read-only view of one boid stored in a BoidSoA
+struct BoidView {
+    const BoidSoA* boids;
+    size_t index;
+
+    Vector2 position() const;
+    Vector2 velocity() const;
+    Vector2 heading() const;
+    void draw() const;
+};
+
+// Structure-of-arrays storage for a flock: every component lives in its own
+// contiguous, aligned array, so a neighbor scan only pulls the floats it reads
+// (8 bytes of position per boid instead of the whole 28-byte Boid).
+struct BoidSoA {
+    AlignedVector<float> px, py;    // Positions
+    AlignedVector<float> vx, vy;    // Velocities
+    AlignedVector<float> hx, hy;    // Headings (unit vectors along the velocities)
+    AlignedVector<float> lastForce; // Size of the steering force at the last full update, for the LOD scheduler
+
+    size_t size() const { return px.size(); }
+
+    void resize(size_t n) {
+        px.resize(n); py.resize(n);
+        vx.resize(n); vy.resize(n);
+        hx.resize(n); hy.resize(n);
+        lastForce.resize(n, INFINITY);  // New boids have no measured force yet, so they are updated right away
+    }
+
+    void reserve(size_t n) {
+        px.reserve(n); py.reserve(n);
+        vx.reserve(n); vy.reserve(n);
+        hx.reserve(n); hy.reserve(n);
+        lastForce.reserve(n);
+    }
+
+    Boid get(size_t i) const;
+    void set(size_t i, const Boid& boid);
+    void push_back(const Boid& boid);
+
+    // Remove the boid at index i by moving the last one into its place
+    void swapRemove(size_t i) {
+        size_t last = size() - 1;
+        px[i] = px[last]; py[i] = py[last];
+        vx[i] = vx[last]; vy[i] = vy[last];
+        hx[i] = hx[last]; hy[i] = hy[last];
+        lastForce[i] = lastForce[last];
+        resize(last);
+    }
+
+    // Fill this storage with from[order[0]], from[order[1]], ...
+    void gather(const BoidSoA& from, const std::vector<int>& order) {
+        resize(order.size());
+        for (size_t e = 0; e < order.size(); e++) {
+            int i = order[e];
+            px[e] = from.px[i]; py[e] = from.py[i];
+            vx[e] = from.vx[i]; vy[e] = from.vy[i];
+            hx[e] = from.hx[i]; hy[e] = from.hy[i];
+            lastForce[e] = from.lastForce[i];
+        }
+    }
+
+    BoidView operator[](size_t i) const { return { this, i }; }
+};
+
+inline Vector2 BoidView::position() const { return { boids->px[index], boids->py[index] }; }
+inline Vector2 BoidView::velocity() const { return { boids->vx[index], boids->vy[index] }; }
+inline Vector2 BoidView::heading() const { return { boids->hx[index], boids->hy[index] }; }
+
+// Angle of a heading in radians, for the few places that really need an angle
+inline float headingAngle(Vector2 heading) {
+    return atan2f(heading.y, heading.x);
+}
+
+// Polynomial approximation of headingAngle (max error about 2e-4 rad), for hot paths
+inline float fastHeadingAngle(Vector2 heading) {
+    float ax = fabsf(heading.x), ay = fabsf(heading.y);
+    float largest = std::max(ax, ay);
+    if (largest == 0.0f) return 0.0f;
+    float a = std::min(ax, ay) / largest;  // Reduce to atan on [0, 1]
+    float s = a * a;
+    float angle = ((-0.0464964749f * s + 0.15931422f) * s - 0.327622764f) * s * a + a;
+    if (ay > ax) angle = PI / 2 - angle;         // Undo the reduction to the first octant
+    if (heading.x < 0) angle = PI - angle;
+    return heading.y < 0 ? -angle : angle;
+}
+
+// Neighbor data read by the neighbor kernels, in the grid's cell order
+struct NeighborArrays {
+    const float* px;
+    const float* py;
+    const float* vx;
+    const float* vy;
+};
+
+// The boid whose neighbors are being accumulated
+struct NeighborQuery {
+    float x, y;                 // Position of the boid
+    float separationRadiusSq;   // Separation radius squared
+    float neighborRadiusSq;     // Neighbor radius squared
+};
+
+// Running sums of the flocking terms over the neighbors of one boid
+struct NeighborSums {
+    float separationX = 0.0f, separationY = 0.0f;  // Sum of the separation pushes (diff / d^2)
+    float velocityX = 0.0f, velocityY = 0.0f;      // Sum of the neighbor velocities (alignment)
+    float positionX = 0.0f, positionY = 0.0f;      // Sum of the neighbor positions (cohesion)
+    int separationCount = 0;                       // Neighbors inside the separation radius
+    int neighborCount = 0;                         // Neighbors inside the neighbor radius
+};
+
+// Neighbor terms a behavior can ask the kernels for (bit flags). The kernels are
+// templates on the set of terms, so terms nobody asks for are not computed at all.
+enum NeighborTerm : unsigned {
+    TERM_SEPARATION = 1,  // separationX/Y and separationCount
+    TERM_VELOCITY = 2,    // velocityX/Y and neighborCount
+    TERM_POSITION = 4,    // positionX/Y and neighborCount
+    TERMS_ALL = 7
+};
+
+// Accumulates the neighbors stored in [begin, end) into sums
+typedef void (*NeighborKernel)(const NeighborArrays& arrays, int begin, int end, const NeighborQuery& query, NeighborSums& sums);
+
+// Portable kernel, also used for the tails the vector kernels leave over
+template <unsigned Terms = TERMS_ALL>
+inline void accumulateNeighborsScalar(const NeighborArrays& arrays, int begin, int end, const NeighborQuery& query, NeighborSums& sums) {
+    for (int j = begin; j < end; j++) {
+        float dx = query.x - arrays.px[j];  // Vector pointing away from the other boid
+        float dy = query.y - arrays.py[j];
+        float d2 = dx * dx + dy * dy;
+        if (d2 > 0 && d2 < query.neighborRadiusSq) {
+            if constexpr ((Terms & TERM_VELOCITY) != 0) {
+                sums.velocityX += arrays.vx[j];
+                sums.velocityY += arrays.vy[j];
+            }
+            if constexpr ((Terms & TERM_POSITION) != 0) {
+                sums.positionX += arrays.px[j];
+                sums.positionY += arrays.py[j];
+            }
+            if constexpr ((Terms & (TERM_VELOCITY | TERM_POSITION)) != 0) sums.neighborCount++;
+            if ((Terms & TERM_SEPARATION) != 0 && d2 < query.separationRadiusSq) {
+                float inverse = 1.0f / d2;  // Normalized diff scaled by 1/d
+                sums.separationX += dx * inverse;
+                sums.separationY += dy * inverse;
+                sums.separationCount++;
+            }
+        }
+    }
+}
+
+// Difference along a wrapping axis, to the nearest periodic image
+inline float wrapDelta(float d, float size) {
+    if (d > size * 0.5f) return d - size;
+    if (d < -size * 0.5f) return d + size;
+    return d;
+}
+
+// Accumulates the neighbors listed in entries[begin, end), indices into arrays (which is in
+// storage order), into sums. Distances are to the nearest image in a wrapping world of
+// width x height, so the list needs no shifts and stays valid while boids wrap.
+typedef void (*NeighborListKernel)(const NeighborArrays& arrays, const int* entries, int begin, int end, const NeighborQuery& query, float width, float height, NeighborSums& sums);
+
+// Portable list kernel, also used for the tails the vector list kernels leave over
+template <unsigned Terms = TERMS_ALL>
+inline void accumulateListScalar(const NeighborArrays& arrays, const int* entries, int begin, int end, const NeighborQuery& query, float width, float height, NeighborSums& sums) {
+    for (int e = begin; e < end; e++) {
+        int j = entries[e];
+        float dx = wrapDelta(query.x - arrays.px[j], width);  // Vector pointing away from the other boid
+        float dy = wrapDelta(query.y - arrays.py[j], height);
+        float d2 = dx * dx + dy * dy;
+        if (d2 > 0 && d2 < query.neighborRadiusSq) {
+            if constexpr ((Terms & TERM_VELOCITY) != 0) {
+                sums.velocityX += arrays.vx[j];
+                sums.velocityY += arrays.vy[j];
+            }
+            if constexpr ((Terms & TERM_POSITION) != 0) {
+                sums.positionX += query.x - dx;  // The nearest image of the other boid
+                sums.positionY += query.y - dy;
+            }
+            if constexpr ((Terms & (TERM_VELOCITY | TERM_POSITION)) != 0) sums.neighborCount++;
+            if ((Terms & TERM_SEPARATION) != 0 && d2 < query.separationRadiusSq) {
+                float inverse = 1.0f / d2;
+                sums.separationX += dx * inverse;
+                sums.separationY += dy * inverse;
+                sums.separationCount++;
+            }
+        }
+    }
+}
+
+// Neighbor data in the grid's compact layout, 8 bytes per boid instead of 16: 16-bit
+// fixed point positions relative to the cell the boid is in, and velocities relative to
+// the fastest component in the flock
+struct CompactNeighborArrays {
+    const uint16_t* px;
+    const uint16_t* py;
+    const int16_t* vx;
+    const int16_t* vy;
+    float positionScaleX, positionScaleY;  // Pixels per position unit (the cell size / 65535)
+    float velocityScale;                   // Pixels per step per velocity unit
+    float cellWidth;                       // Distance between the origins of neighboring cells in a row
+    float selfDistanceSq;                  // Squared distances below this (a quarter unit) are the boid itself
+};
+
+// Accumulates the neighbors in [begin, end) that lie in the cells [firstCell, lastCell] of
+// one row into sums. The query position is relative to the origin of firstCell, and so are
+// the position sums.
+typedef void (*CompactNeighborKernel)(const CompactNeighborArrays& arrays, const int* cellStart, int firstCell, int lastCell, int begin, int end,
+                                      const NeighborQuery& query, NeighborSums& sums);
+
+// Portable compact kernel
+template <unsigned Terms = TERMS_ALL>
+inline void accumulateCompactScalar(const CompactNeighborArrays& arrays, const int* cellStart, int firstCell, int lastCell, int begin, int end,
+                                    const NeighborQuery& query, NeighborSums& sums) {
+    for (int c = firstCell; c <= lastCell; c++) {
+        float cellX = (c - firstCell) * arrays.cellWidth;  // Origin of this cell, relative to firstCell's
+        int cellEnd = std::min(end, cellStart[c + 1]);
+        for (int j = std::max(begin, cellStart[c]); j < cellEnd; j++) {
+            float otherX = (float)arrays.px[j] * arrays.positionScaleX + cellX;
+            float otherY = (float)arrays.py[j] * arrays.positionScaleY;
+            float dx = query.x - otherX;  // Vector pointing away from the other boid
+            float dy = query.y - otherY;
+            float d2 = dx * dx + dy * dy;
+            if (d2 > arrays.selfDistanceSq && d2 < query.neighborRadiusSq) {
+                if constexpr ((Terms & TERM_VELOCITY) != 0) {
+                    sums.velocityX += (float)arrays.vx[j] * arrays.velocityScale;
+                    sums.velocityY += (float)arrays.vy[j] * arrays.velocityScale;
+                }
+                if constexpr ((Terms & TERM_POSITION) != 0) {
+                    sums.positionX += otherX;
+                    sums.positionY += otherY;
+                }
+                if constexpr ((Terms & (TERM_VELOCITY | TERM_POSITION)) != 0) sums.neighborCount++;
+                if ((Terms & TERM_SEPARATION) != 0 && d2 < query.separationRadiusSq) {
+                    float inverse = 1.0f / d2;
+                    sums.separationX += dx * inverse;
+                    sums.separationY += dy * inverse;
+                    sums.separationCount++;
+                }
+            }
+        }
+    }
+}
+
+// The vector kernels test 8 (AVX2) or 4 (SSE4/NEON) neighbors at a time. The radius
+// tests become lane masks that are ANDed into the terms before adding them, and 1/d^2
+// uses the hardware reciprocal estimate refined by one Newton step.
+#if FLOCK_X86
+FLOCK_TARGET("avx2,fma")
+inline float horizontalSum(__m256 v) {
+    __m128 sum = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+    sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+    return _mm_cvtss_f32(sum);
+}
+
+template <unsigned Terms = TERMS_ALL>
+FLOCK_TARGET("avx2,fma")
+void accumulateNeighborsAVX2(const NeighborArrays& arrays, int begin, int end, const NeighborQuery& query, NeighborSums& sums) {
+    const __m256 x = _mm256_set1_ps(query.x);
+    const __m256 y = _mm256_set1_ps(query.y);
+    const __m256 separationRadiusSq = _mm256_set1_ps(query.separationRadiusSq);
+    const __m256 neighborRadiusSq = _mm256_set1_ps(query.neighborRadiusSq);
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256 two = _mm256_set1_ps(2.0f);
+
+    __m256 separationX = zero, separationY = zero, separationCount = zero;
+    __m256 velocityX = zero, velocityY = zero;
+    __m256 positionX = zero, positionY = zero, neighborCount = zero;
+
+    int j = begin;
+    for (; j + 8 <= end; j += 8) {
+        __m256 otherX = _mm256_loadu_ps(arrays.px + j);
+        __m256 otherY = _mm256_loadu_ps(arrays.py + j);
+        __m256 dx = _mm256_sub_ps(x, otherX);
+        __m256 dy = _mm256_sub_ps(y, otherY);
+        __m256 d2 = _mm256_fmadd_ps(dx, dx, _mm256_mul_ps(dy, dy));
+
+        __m256 isNeighbor = _mm256_and_ps(_mm256_cmp_ps(d2, zero, _CMP_GT_OQ), _mm256_cmp_ps(d2, neighborRadiusSq, _CMP_LT_OQ));
+
+        if constexpr ((Terms & TERM_VELOCITY) != 0) {
+            velocityX = _mm256_add_ps(velocityX, _mm256_and_ps(isNeighbor, _mm256_loadu_ps(arrays.vx + j)));
+            velocityY = _mm256_add_ps(velocityY, _mm256_and_ps(isNeighbor, _mm256_loadu_ps(arrays.vy + j)));
+        }
+        if constexpr ((Terms & TERM_POSITION) != 0) {
+            positionX = _mm256_add_ps(positionX, _mm256_and_ps(isNeighbor, otherX));
+            positionY = _mm256_add_ps(positionY, _mm256_and_ps(isNeighbor, otherY));
+        }
+        if constexpr ((Terms & (TERM_VELOCITY | TERM_POSITION)) != 0) {
+            neighborCount = _mm256_add_ps(neighborCount, _mm256_and_ps(isNeighbor, one));
+        }
+
+        if constexpr ((Terms & TERM_SEPARATION) != 0) {
+            __m256 isClose = _mm256_and_ps(isNeighbor, _mm256_cmp_ps(d2, separationRadiusSq, _CMP_LT_OQ));
+            __m256 inverse = _mm256_rcp_ps(d2);
+            inverse = _mm256_mul_ps(inverse, _mm256_fnmadd_ps(d2, inverse, two));  // r' = r * (2 - d2 * r)
+            separationX = _mm256_add_ps(separationX, _mm256_and_ps(isClose, _mm256_mul_ps(dx, inverse)));
+            separationY = _mm256_add_ps(separationY, _mm256_and_ps(isClose, _mm256_mul_ps(dy, inverse)));
+            separationCount = _mm256_add_ps(separationCount, _mm256_and_ps(isClose, one));
+        }
+    }
+
+    if constexpr ((Terms & TERM_SEPARATION) != 0) {
+        sums.separationX += horizontalSum(separationX);
+        sums.separationY += horizontalSum(separationY);
+    }
+    if constexpr ((Terms & TERM_VELOCITY) != 0) {
+        sums.velocityX += horizontalSum(velocityX);
+        sums.velocityY += horizontalSum(velocityY);
+    }
+    if constexpr ((Terms & TERM_POSITION) != 0) {
+        sums.positionX += horizontalSum(positionX);
+        sums.positionY += horizontalSum(positionY);
+    }
+    if constexpr ((Terms & TERM_SEPARATION) != 0) sums.separationCount += (int)horizontalSum(separationCount);
+    if constexpr ((Terms & (TERM_VELOCITY | TERM_POSITION)) != 0) sums.neighborCount += (int)horizontalSum(neighborCount);
+
+    accumulateNeighborsScalar<Terms>(arrays, j, end, query, sums);
+}
+
+// AVX2 list kernel: the same lane arithmetic, with the neighbor data fetched by gathers
+template <unsigned Terms = TERMS_ALL>
+FLOCK_TARGET("avx2,fma")
+void accumulateListAVX2(const NeighborArrays& arrays, const int* entries, int begin, int end, const NeighborQuery& query, float width, float height, NeighborSums& sums) {
+    const __m256 x = _mm256_set1_ps(query.x);
+    const __m256 y = _mm256_set1_ps(query.y);
+    const __m256 separationRadiusSq = _mm256_set1_ps(query.separationRadiusSq);
+    const __m256 neighborRadiusSq = _mm256_set1_ps(query.neighborRadiusSq);
+    const __m256 worldX = _mm256_set1_ps(width), halfX = _mm256_set1_ps(width * 0.5f), minusHalfX = _mm256_set1_ps(-width * 0.5f);
+    const __m256 worldY = _mm256_set1_ps(height), halfY = _mm256_set1_ps(height * 0.5f), minusHalfY = _mm256_set1_ps(-height * 0.5f);
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256 two = _mm256_set1_ps(2.0f);
+
+    __m256 separationX = zero, separationY = zero, separationCount = zero;
+    __m256 velocityX = zero, velocityY = zero;
+    __m256 positionX = zero, positionY = zero, neighborCount = zero;
+
+    int e = begin;
+    for (; e + 8 <= end; e += 8) {
+        __m256i index = _mm256_loadu_si256((const __m256i*)(entries + e));
+        __m256 dx = _mm256_sub_ps(x, _mm256_i32gather_ps(arrays.px, index, 4));
+        __m256 dy = _mm256_sub_ps(y, _mm256_i32gather_ps(arrays.py, index, 4));
+        dx = _mm256_sub_ps(dx, _mm256_and_ps(_mm256_cmp_ps(dx, halfX, _CMP_GT_OQ), worldX));  // Nearest image, as wrapDelta
+        dx = _mm256_add_ps(dx, _mm256_and_ps(_mm256_cmp_ps(dx, minusHalfX, _CMP_LT_OQ), worldX));
+        dy = _mm256_sub_ps(dy, _mm256_and_ps(_mm256_cmp_ps(dy, halfY, _CMP_GT_OQ), worldY));
+        dy = _mm256_add_ps(dy, _mm256_and_ps(_mm256_cmp_ps(dy, minusHalfY, _CMP_LT_OQ), worldY));
+        __m256 d2 = _mm256_fmadd_ps(dx, dx, _mm256_mul_ps(dy, dy));
+
+        __m256 isNeighbor = _mm256_and_ps(_mm256_cmp_ps(d2, zero, _CMP_GT_OQ), _mm256_cmp_ps(d2, neighborRadiusSq, _CMP_LT_OQ));
+
+        if constexpr ((Terms & TERM_VELOCITY) != 0) {
+            velocityX = _mm256_add_ps(velocityX, _mm256_and_ps(isNeighbor, _mm256_i32gather_ps(arrays.vx, index, 4)));
+            velocityY = _mm256_add_ps(velocityY, _mm256_and_ps(isNeighbor, _mm256_i32gather_ps(arrays.vy, index, 4)));
+        }
+        if constexpr ((Terms & TERM_POSITION) != 0) {
+            positionX = _mm256_add_ps(positionX, _mm256_and_ps(isNeighbor, _mm256_sub_ps(x, dx)));
+            positionY = _mm256_add_ps(positionY, _mm256_and_ps(isNeighbor, _mm256_sub_ps(y, dy)));
+        }
+        if constexpr ((Terms & (TERM_VELOCITY | TERM_POSITION)) != 0) {
+            neighborCount = _mm256_add_ps(neighborCount, _mm256_and_ps(isNeighbor, one));
+        }
+
+        if constexpr ((Terms & TERM_SEPARATION) != 0) {
+            __m256 isClose = _mm256_and_ps(isNeighbor, _mm256_cmp_ps(d2, separationRadiusSq, _CMP_LT_OQ));
+            __m256 inverse = _mm256_rcp_ps(d2);
+            inverse = _mm256_mul_ps(inverse, _mm256_fnmadd_ps(d2, inverse, two));  // r' = r * (2 - d2 * r)
+            separationX = _mm256_add_ps(separationX, _mm256_and_ps(isClose, _mm256_mul_ps(dx, inverse)));
+            separationY = _mm256_add_ps(separationY, _mm256_and_ps(isClose, _mm256_mul_ps(dy, inverse)));
+            separationCount = _mm256_add_ps(separationCount, _mm256_and_ps(isClose, one));
+        }
+    }
+
+    if constexpr ((Terms & TERM_SEPARATION) != 0) {
+        sums.separationX += horizontalSum(separationX);
+        sums.separationY += horizontalSum(separationY);
+    }
+    if constexpr ((Terms & TERM_VELOCITY) != 0) {
+        sums.velocityX += horizontalSum(velocityX);
+        sums.velocityY += horizontalSum(velocityY);
+    }
+    if constexpr ((Terms & TERM_POSITION) != 0) {
+        sums.positionX += horizontalSum(positionX);
+        sums.positionY += horizontalSum(positionY);
+    }
+    if constexpr ((Terms & TERM_SEPARATION) != 0) sums.separationCount += (int)horizontalSum(separationCount);
+    if constexpr ((Terms & (TERM_VELOCITY | TERM_POSITION)) != 0) sums.neighborCount += (int)horizontalSum(neighborCount);
+
+    accumulateListScalar<Terms>(arrays, entries, e, end, query, width, height, sums);
+}
+
+// AVX2 compact kernel: the 16-bit lanes are widened and scaled to floats in registers. Cells
+// are short, so the last partial vector of each is masked instead of left to a scalar tail;
+// it reads up to 7 entries past the cell, which the grid pads its compact arrays for.
+template <unsigned Terms = TERMS_ALL>
+FLOCK_TARGET("avx2,fma")
+void accumulateCompactAVX2(const CompactNeighborArrays& arrays, const int* cellStart, int firstCell, int lastCell, int begin, int end,
+                           const NeighborQuery& query, NeighborSums& sums) {
+    const __m256 x = _mm256_set1_ps(query.x);
+    const __m256 y = _mm256_set1_ps(query.y);
+    const __m256 separationRadiusSq = _mm256_set1_ps(query.separationRadiusSq);
+    const __m256 neighborRadiusSq = _mm256_set1_ps(query.neighborRadiusSq);
+    const __m256 selfDistanceSq = _mm256_set1_ps(arrays.selfDistanceSq);
+    const __m256 positionScaleX = _mm256_set1_ps(arrays.positionScaleX);
+    const __m256 positionScaleY = _mm256_set1_ps(arrays.positionScaleY);
+    const __m256 velocityScale = _mm256_set1_ps(arrays.velocityScale);
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256 two = _mm256_set1_ps(2.0f);
+    const __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+
+    __m256 separationX = zero, separationY = zero, separationCount = zero;
+    __m256 velocityX = zero, velocityY = zero;
+    __m256 positionX = zero, positionY = zero, neighborCount = zero;
+
+    for (int c = firstCell; c <= lastCell; c++) {
+        const __m256 cellX = _mm256_set1_ps((c - firstCell) * arrays.cellWidth);  // Origin of this cell, relative to firstCell's
+        int cellEnd = std::min(end, cellStart[c + 1]);
+        for (int j = std::max(begin, cellStart[c]); j < cellEnd; j += 8) {
+            __m256 inRange = _mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_set1_epi32(cellEnd - j), lane));  // Lanes before the cell's end
+            __m256 otherX = _mm256_fmadd_ps(_mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(arrays.px + j)))), positionScaleX, cellX);
+            __m256 otherY = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(arrays.py + j)))), positionScaleY);
+            __m256 dx = _mm256_sub_ps(x, otherX);
+            __m256 dy = _mm256_sub_ps(y, otherY);
+            __m256 d2 = _mm256_fmadd_ps(dx, dx, _mm256_mul_ps(dy, dy));
+
+            __m256 isNeighbor = _mm256_and_ps(_mm256_and_ps(_mm256_cmp_ps(d2, selfDistanceSq, _CMP_GT_OQ), _mm256_cmp_ps(d2, neighborRadiusSq, _CMP_LT_OQ)), inRange);
+
+            if constexpr ((Terms & TERM_VELOCITY) != 0) {
+                __m256 otherVx = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)(arrays.vx + j))));  // Still in velocity units, scaled once after the loop
+                __m256 otherVy = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)(arrays.vy + j))));
+                velocityX = _mm256_add_ps(velocityX, _mm256_and_ps(isNeighbor, otherVx));
+                velocityY = _mm256_add_ps(velocityY, _mm256_and_ps(isNeighbor, otherVy));
+            }
+            if constexpr ((Terms & TERM_POSITION) != 0) {
+                positionX = _mm256_add_ps(positionX, _mm256_and_ps(isNeighbor, otherX));
+                positionY = _mm256_add_ps(positionY, _mm256_and_ps(isNeighbor, otherY));
+            }
+            if constexpr ((Terms & (TERM_VELOCITY | TERM_POSITION)) != 0) {
+                neighborCount = _mm256_add_ps(neighborCount, _mm256_and_ps(isNeighbor, one));
+            }
+
+            if constexpr ((Terms & TERM_SEPARATION) != 0) {
+                __m256 isClose = _mm256_and_ps(isNeighbor, _mm256_cmp_ps(d2, separationRadiusSq, _CMP_LT_OQ));
+                __m256 inverse = _mm256_rcp_ps(d2);
+                inverse = _mm256_mul_ps(inverse, _mm256_fnmadd_ps(d2, inverse, two));  // r' = r * (2 - d2 * r)
+                separationX = _mm256_add_ps(separationX, _mm256_and_ps(isClose, _mm256_mul_ps(dx, inverse)));
+                separationY = _mm256_add_ps(separationY, _mm256_and_ps(isClose, _mm256_mul_ps(dy, inverse)));
+                separationCount = _mm256_add_ps(separationCount, _mm256_and_ps(isClose, one));
+            }
+        }
+    }
+
+    if constexpr ((Terms & TERM_SEPARATION) != 0) {
+        sums.separationX += horizontalSum(separationX);
+        sums.separationY += horizontalSum(separationY);
+    }
+    if constexpr ((Terms & TERM_VELOCITY) != 0) {
+        sums.velocityX += horizontalSum(_mm256_mul_ps(velocityX, velocityScale));
+        sums.velocityY += horizontalSum(_mm256_mul_ps(velocityY, velocityScale));
+    }
+    if constexpr ((Terms & TERM_POSITION) != 0) {
+        sums.positionX += horizontalSum(positionX);
+        sums.positionY += horizontalSum(positionY);
+    }
+    if constexpr ((Terms & TERM_SEPARATION) != 0) sums.separationCount += (int)horizontalSum(separationCount);
+    if constexpr ((Terms & (TERM_VELOCITY | TERM_POSITION)) != 0) sums.neighborCount += (int)horizontalSum(neighborCount);
+}
+
+FLOCK_TARGET("sse4.1")
+inline float horizontalSum(__m128 v) {
+    v = _mm_add_ps(v, _mm_movehl_ps(v, v));
+    v = _mm_add_ss(v, _mm_shuffle_ps(v, v, 1));
+    return _mm_cvtss_f32(v);
+}
+
+template <unsigned Terms = TERMS_ALL>
+FLOCK_TARGET("sse4.1")
+void accumulateNeighborsSSE4(const NeighborArrays& arrays, int begin, int end, const NeighborQuery& query, NeighborSums& sums) {
+    const __m128 x = _mm_set1_ps(query.x);
+    const __m128 y = _mm_set1_ps(query.y);
+    const __m128 separationRadiusSq = _mm_set1_ps(query.separationRadiusSq);
+    const __m128 neighborRadiusSq = _mm_set1_ps(query.neighborRadiusSq);
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 two = _mm_set1_ps(2.0f);
+
+    __m128 separationX = zero, separationY = zero, separationCount = zero;
+    __m128 velocityX = zero, velocityY = zero;
+    __m128 positionX = zero, positionY = zero, neighborCount = zero;
+
+    int j = begin;
+    for (; j + 4 <= end; j += 4) {
+        __m128 otherX = _mm_loadu_ps(arrays.px + j);
+        __m128 otherY = _mm_loadu_ps(arrays.py + j);
+        __m128 dx = _mm_sub_ps(x, otherX);
+        __m128 dy = _mm_sub_ps(y, otherY);
+        __m128 d2 = _mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy));
+
+        __m128 isNeighbor = _mm_and_ps(_mm_cmpgt_ps(d2, zero), _mm_cmplt_ps(d2, neighborRadiusSq));
+
+        if constexpr ((Terms & TERM_VELOCITY) != 0) {
+            velocityX = _mm_add_ps(velocityX, _mm_and_ps(isNeighbor, _mm_loadu_ps(arrays.vx + j)));
+            velocityY = _mm_add_ps(velocityY, _mm_and_ps(isNeighbor, _mm_loadu_ps(arrays.vy + j)));
+        }
+        if constexpr ((Terms & TERM_POSITION) != 0) {
+            positionX = _mm_add_ps(positionX, _mm_and_ps(isNeighbor, otherX));
+            positionY = _mm_add_ps(positionY, _mm_and_ps(isNeighbor, otherY));
+        }
+        if constexpr ((Terms & (TERM_VELOCITY | TERM_POSITION)) != 0) {
+            neighborCount = _mm_add_ps(neighborCount, _mm_and_ps(isNeighbor, one));
+        }
+
+        if constexpr ((Terms & TERM_SEPARATION) != 0) {
+            __m128 isClose = _mm_and_ps(isNeighbor, _mm_cmplt_ps(d2, separationRadiusSq));
+            __m128 inverse = _mm_rcp_ps(d2);
+            inverse = _mm_mul_ps(inverse, _mm_sub_ps(two, _mm_mul_ps(d2, inverse)));  // r' = r * (2 - d2 * r)
+            separationX = _mm_add_ps(separationX, _mm_and_ps(isClose, _mm_mul_ps(dx, inverse)));
+            separationY = _mm_add_ps(separationY, _mm_and_ps(isClose, _mm_mul_ps(dy, inverse)));
+            separationCount = _mm_add_ps(separationCount, _mm_and_ps(isClose, one));
+        }
+    }
+
+    if constexpr ((Terms & TERM_SEPARATION) != 0) {
+        sums.separationX += horizontalSum(separationX);
+        sums.separationY += horizontalSum(separationY);
+    }
+    if constexpr ((Terms & TERM_VELOCITY) != 0) {
+        sums.velocityX += horizontalSum(velocityX);
+        sums.velocityY += horizontalSum(velocityY);
+    }
+    if constexpr ((Terms & TERM_POSITION) != 0) {
+        sums.positionX += horizontalSum(positionX);
+        sums.positionY += horizontalSum(positionY);
+    }
+    if constexpr ((Terms & TERM_SEPARATION) != 0) sums.separationCount += (int)horizontalSum(separationCount);
+    if constexpr ((Terms & (TERM_VELOCITY | TERM_POSITION)) != 0) sums.neighborCount += (int)horizontalSum(neighborCount);
+
+    accumulateNeighborsScalar<Terms>(arrays, j, end, query, sums);
+}
+
+// SSE4 list kernel: SSE4 has no gathers, so the four neighbors of a step are loaded one by one
+template <unsigned Terms = TERMS_ALL>
+FLOCK_TARGET("sse4.1")
+void accumulateListSSE4(const NeighborArrays& arrays, const int* entries, int begin, int end, const NeighborQuery& query, float width, float height, NeighborSums& sums) {
+    const __m128 x = _mm_set1_ps(query.x);
+    const __m128 y = _mm_set1_ps(query.y);
+    const __m128 separationRadiusSq = _mm_set1_ps(query.separationRadiusSq);
+    const __m128 neighborRadiusSq = _mm_set1_ps(query.neighborRadiusSq);
+    const __m128 worldX = _mm_set1_ps(width), halfX = _mm_set1_ps(width * 0.5f), minusHalfX = _mm_set1_ps(-width * 0.5f);
+    const __m128 worldY = _mm_set1_ps(height), halfY = _mm_set1_ps(height * 0.5f), minusHalfY = _mm_set1_ps(-height * 0.5f);
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 two = _mm_set1_ps(2.0f);
+
+    __m128 separationX = zero, separationY = zero, separationCount = zero;
+    __m128 velocityX = zero, velocityY = zero;
+    __m128 positionX = zero, positionY = zero, neighborCount = zero;
+
+    int e = begin;
+    for (; e + 4 <= end; e += 4) {
+        const int* j = entries + e;
+        __m128 dx = _mm_sub_ps(x, _mm_setr_ps(arrays.px[j[0]], arrays.px[j[1]], arrays.px[j[2]], arrays.px[j[3]]));
+        __m128 dy = _mm_sub_ps(y, _mm_setr_ps(arrays.py[j[0]], arrays.py[j[1]], arrays.py[j[2]], arrays.py[j[3]]));
+        dx = _mm_sub_ps(dx, _mm_and_ps(_mm_cmpgt_ps(dx, halfX), worldX));  // Nearest image, as wrapDelta
+        dx = _mm_add_ps(dx, _mm_and_ps(_mm_cmplt_ps(dx, minusHalfX), worldX));
+        dy = _mm_sub_ps(dy, _mm_and_ps(_mm_cmpgt_ps(dy, halfY), worldY));
+        dy = _mm_add_ps(dy, _mm_and_ps(_mm_cmplt_ps(dy, minusHalfY), worldY));
+        __m128 d2 = _mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy));
+
+        __m128 isNeighbor = _mm_and_ps(_mm_cmpgt_ps(d2, zero), _mm_cmplt_ps(d2, neighborRadiusSq));
+
+        if constexpr ((Terms & TERM_VELOCITY) != 0) {
+            __m128 otherVx = _mm_setr_ps(arrays.vx[j[0]], arrays.vx[j[1]], arrays.vx[j[2]], arrays.vx[j[3]]);
+            __m128 otherVy = _mm_setr_ps(arrays.vy[j[0]], arrays.vy[j[1]], arrays.vy[j[2]], arrays.vy[j[3]]);
+            velocityX = _mm_add_ps(velocityX, _mm_and_ps(isNeighbor, otherVx));
+            velocityY = _mm_add_ps(velocityY, _mm_and_ps(isNeighbor, otherVy));
+        }
+        if constexpr ((Terms & TERM_POSITION) != 0) {
+            positionX = _mm_add_ps(positionX, _mm_and_ps(isNeighbor, _mm_sub_ps(x, dx)));
+            positionY = _mm_add_ps(positionY, _mm_and_ps(isNeighbor, _mm_sub_ps(y, dy)));
+        }
+        if constexpr ((Terms & (TERM_VELOCITY | TERM_POSITION)) != 0) {
+            neighborCount = _mm_add_ps(neighborCount, _mm_and_ps(isNeighbor, one));
+        }
+
+        if constexpr ((Terms & TERM_SEPARATION) != 0) {
+            __m128 isClose = _mm_and_ps(isNeighbor, _mm_cmplt_ps(d2, separationRadiusSq));
+            __m128 inverse = _mm_rcp_ps(d2);
+            inverse = _mm_mul_ps(inverse, _mm_sub_ps(two, _mm_mul_ps(d2, inverse)));  // r' = r * (2 - d2 * r)
+            separationX = _mm_add_ps(separationX, _mm_and_ps(isClose, _mm_mul_ps(dx, inverse)));
+            separationY = _mm_add_ps(separationY, _mm_and_ps(isClose, _mm_mul_ps(dy, inverse)));
+            separationCount = _mm_add_ps(separationCount, _mm_and_ps(isClose, one));
+        }
+    }
+
+    if constexpr ((Terms & TERM_SEPARATION) != 0) {
+        sums.separationX += horizontalSum(separationX);
+        sums.separationY += horizontalSum(separationY);
+    }
+    if constexpr ((Terms & TERM_VELOCITY) != 0) {
+        sums.velocityX += horizontalSum(velocityX);
+        sums.velocityY += horizontalSum(velocityY);
+    }
+    if constexpr ((Terms & TERM_POSITION) != 0) {
+        sums.positionX += horizontalSum(positionX);
+        sums.positionY += horizontalSum(positionY);
+    }
+    if constexpr ((Terms & TERM_SEPARATION) != 0) sums.separationCount += (int)horizontalSum(separationCount);
+    if constexpr ((Terms & (TERM_VELOCITY | TERM_POSITION)) != 0) sums.neighborCount += (int)horizontalSum(neighborCount);
+
+    accumulateListScalar<Terms>(arrays, entries, e, end, query, width, height, sums);
+}
+
+// SSE4 compact kernel: pmovzxwd/pmovsxwd widen four 16-bit lanes at a time (masked tails as in AVX2)
+template <unsigned Terms = TERMS_ALL>
+FLOCK_TARGET("sse4.1")
+void accumulateCompactSSE4(const CompactNeighborArrays& arrays, const int* cellStart, int firstCell, int lastCell, int begin, int end,
+                           const NeighborQuery& query, NeighborSums& sums) {
+    const __m128 x = _mm_set1_ps(query.x);
+    const __m128 y = _mm_set1_ps(query.y);
+    const __m128 separationRadiusSq = _mm_set1_ps(query.separationRadiusSq);
+    const __m128 neighborRadiusSq = _mm_set1_ps(query.neighborRadiusSq);
+    const __m128 selfDistanceSq = _mm_set1_ps(arrays.selfDistanceSq);
+    const __m128 positionScaleX = _mm_set1_ps(arrays.positionScaleX);
+    const __m128 positionScaleY = _mm_set1_ps(arrays.positionScaleY);
+    const __m128 velocityScale = _mm_set1_ps(arrays.velocityScale);
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 two = _mm_set1_ps(2.0f);
+    const __m128i lane = _mm_setr_epi32(0, 1, 2, 3);
+
+    __m128 separationX = zero, separationY = zero, separationCount = zero;
+    __m128 velocityX = zero, velocityY = zero;
+    __m128 positionX = zero, positionY = zero, neighborCount = zero;
+
+    for (int c = firstCell; c <= lastCell; c++) {
+        const __m128 cellX = _mm_set1_ps((c - firstCell) * arrays.cellWidth);  // Origin of this cell, relative to firstCell's
+        int cellEnd = std::min(end, cellStart[c + 1]);
+        for (int j = std::max(begin, cellStart[c]); j < cellEnd; j += 4) {
+            __m128 inRange = _mm_castsi128_ps(_mm_cmpgt_epi32(_mm_set1_epi32(cellEnd - j), lane));  // Lanes before the cell's end
+            __m128 otherX = _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_cvtepu16_epi32(_mm_loadl_epi64((const __m128i*)(arrays.px + j)))), positionScaleX), cellX);
+            __m128 otherY = _mm_mul_ps(_mm_cvtepi32_ps(_mm_cvtepu16_epi32(_mm_loadl_epi64((const __m128i*)(arrays.py + j)))), positionScaleY);
+            __m128 dx = _mm_sub_ps(x, otherX);
+            __m128 dy = _mm_sub_ps(y, otherY);
+            __m128 d2 = _mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy));
+
+            __m128 isNeighbor = _mm_and_ps(_mm_and_ps(_mm_cmpgt_ps(d2, selfDistanceSq), _mm_cmplt_ps(d2, neighborRadiusSq)), inRange);
+
+            if constexpr ((Terms & TERM_VELOCITY) != 0) {
+                __m128 otherVx = _mm_cvtepi32_ps(_mm_cvtepi16_epi32(_mm_loadl_epi64((const __m128i*)(arrays.vx + j))));  // Still in velocity units, scaled once after the loop
+                __m128 otherVy = _mm_cvtepi32_ps(_mm_cvtepi16_epi32(_mm_loadl_epi64((const __m128i*)(arrays.vy + j))));
+                velocityX = _mm_add_ps(velocityX, _mm_and_ps(isNeighbor, otherVx));
+                velocityY = _mm_add_ps(velocityY, _mm_and_ps(isNeighbor, otherVy));
+            }
+            if constexpr ((Terms & TERM_POSITION) != 0) {
+                positionX = _mm_add_ps(positionX, _mm_and_ps(isNeighbor, otherX));
+                positionY = _mm_add_ps(positionY, _mm_and_ps(isNeighbor, otherY));
+            }
+            if constexpr ((Terms & (TERM_VELOCITY | TERM_POSITION)) != 0) {
+                neighborCount = _mm_add_ps(neighborCount, _mm_and_ps(isNeighbor, one));
+            }
+
+            if constexpr ((Terms & TERM_SEPARATION) != 0) {
+                __m128 isClose = _mm_and_ps(isNeighbor, _mm_cmplt_ps(d2, separationRadiusSq));
+                __m128 inverse = _mm_rcp_ps(d2);
+                inverse = _mm_mul_ps(inverse, _mm_sub_ps(two, _mm_mul_ps(d2, inverse)));  // r' = r * (2 - d2 * r)
+                separationX = _mm_add_ps(separationX, _mm_and_ps(isClose, _mm_mul_ps(dx, inverse)));
+                separationY = _mm_add_ps(separationY, _mm_and_ps(isClose, _mm_mul_ps(dy, inverse)));
+                separationCount = _mm_add_ps(separationCount, _mm_and_ps(isClose, one));
+            }
+        }
+    }
+
+    if constexpr ((Terms & TERM_SEPARATION) != 0) {
+        sums.separationX += horizontalSum(separationX);
+        sums.separationY += horizontalSum(separationY);
+    }
+    if constexpr ((Terms & TERM_VELOCITY) != 0) {
+        sums.velocityX += horizontalSum(_mm_mul_ps(velocityX, velocityScale));
+        sums.velocityY += horizontalSum(_mm_mul_ps(velocityY, velocityScale));
+    }
+    if constexpr ((Terms & TERM_POSITION) != 0) {
+        sums.positionX += horizontalSum(positionX);
+        sums.positionY += horizontalSum(positionY);
+    }
+    if constexpr ((Terms & TERM_SEPARATION) != 0) sums.separationCount += (int)horizontalSum(separationCount);
+    if constexpr ((Terms & (TERM_VELOCITY | TERM_POSITION)) != 0) sums.neighborCount += (int)horizontalSum(neighborCount);
+}
+#endif
+
+#if FLOCK_NEON
+inline float horizontalSum(float32x4_t v) {
+    float32x2_t sum = vadd_f32(vget_low_f32(v), vget_high_f32(v));
+    return vget_lane_f32(vpadd_f32(sum, sum), 0);
+}
+
+// Zero the lanes of v where mask is not set
+inline float32x4_t maskLanes(uint32x4_t mask, float32x4_t v) {
+    return vreinterpretq_f32_u32(vandq_u32(mask, vreinterpretq_u32_f32(v)));
+}
+
+template <unsigned Terms = TERMS_ALL>
+void accumulateNeighborsNEON(const NeighborArrays& arrays, int begin, int end, const NeighborQuery& query, NeighborSums& sums) {
+    const float32x4_t x = vdupq_n_f32(query.x);
+    const float32x4_t y = vdupq_n_f32(query.y);
+    const float32x4_t separationRadiusSq = vdupq_n_f32(query.separationRadiusSq);
+    const float32x4_t neighborRadiusSq = vdupq_n_f32(query.neighborRadiusSq);
+    const float32x4_t zero = vdupq_n_f32(0.0f);
+    const float32x4_t one = vdupq_n_f32(1.0f);
+
+    float32x4_t separationX = zero, separationY = zero, separationCount = zero;
+    float32x4_t velocityX = zero, velocityY = zero;
+    float32x4_t positionX = zero, positionY = zero, neighborCount = zero;
+
+    int j = begin;
+    for (; j + 4 <= end; j += 4) {
+        float32x4_t otherX = vld1q_f32(arrays.px + j);
+        float32x4_t otherY = vld1q_f32(arrays.py + j);
+        float32x4_t dx = vsubq_f32(x, otherX);
+        float32x4_t dy = vsubq_f32(y, otherY);
+        float32x4_t d2 = vmlaq_f32(vmulq_f32(dy, dy), dx, dx);
+
+        uint32x4_t isNeighbor = vandq_u32(vcgtq_f32(d2, zero), vcltq_f32(d2, neighborRadiusSq));
+
+        if constexpr ((Terms & TERM_VELOCITY) != 0) {
+            velocityX = vaddq_f32(velocityX, maskLanes(isNeighbor, vld1q_f32(arrays.vx + j)));
+            velocityY = vaddq_f32(velocityY, maskLanes(isNeighbor, vld1q_f32(arrays.vy + j)));
+        }
+        if constexpr ((Terms & TERM_POSITION) != 0) {
+            positionX = vaddq_f32(positionX, maskLanes(isNeighbor, otherX));
+            positionY = vaddq_f32(positionY, maskLanes(isNeighbor, otherY));
+        }
+        if constexpr ((Terms & (TERM_VELOCITY | TERM_POSITION)) != 0) {
+            neighborCount = vaddq_f32(neighborCount, maskLanes(isNeighbor, one));
+        }
+
+        if constexpr ((Terms & TERM_SEPARATION) != 0) {
+            uint32x4_t isClose = vandq_u32(isNeighbor, vcltq_f32(d2, separationRadiusSq));
+            float32x4_t inverse = vrecpeq_f32(d2);
+            inverse = vmulq_f32(inverse, vrecpsq_f32(d2, inverse));  // r' = r * (2 - d2 * r)
+            separationX = vaddq_f32(separationX, maskLanes(isClose, vmulq_f32(dx, inverse)));
+            separationY = vaddq_f32(separationY, maskLanes(isClose, vmulq_f32(dy, inverse)));
+            separationCount = vaddq_f32(separationCount, maskLanes(isClose, one));
+        }
+    }
+
+    if constexpr ((Terms & TERM_SEPARATION) != 0) {
+        sums.separationX += horizontalSum(separationX);
+        sums.separationY += horizontalSum(separationY);
+    }
+    if constexpr ((Terms & TERM_VELOCITY) != 0) {
+        sums.velocityX += horizontalSum(velocityX);
+        sums.velocityY += horizontalSum(velocityY);
+    }
+    if constexpr ((Terms & TERM_POSITION) != 0) {
+        sums.positionX += horizontalSum(positionX);
+        sums.positionY += horizontalSum(positionY);
+    }
+    if constexpr ((Terms & TERM_SEPARATION) != 0) sums.separationCount += (int)horizontalSum(separationCount);
+    if constexpr ((Terms & (TERM_VELOCITY | TERM_POSITION)) != 0) sums.neighborCount += (int)horizontalSum(neighborCount);
+
+    accumulateNeighborsScalar<Terms>(arrays, j, end, query, sums);
+}
+
+// NEON list kernel: the four neighbors of a step are loaded one by one into the lanes
+template <unsigned Terms = TERMS_ALL>
+void accumulateListNEON(const NeighborArrays& arrays, const int* entries, int begin, int end, const NeighborQuery& query, float width, float height, NeighborSums& sums) {
+    const float32x4_t x = vdupq_n_f32(query.x);
+    const float32x4_t y = vdupq_n_f32(query.y);
+    const float32x4_t separationRadiusSq = vdupq_n_f32(query.separationRadiusSq);
+    const float32x4_t neighborRadiusSq = vdupq_n_f32(query.neighborRadiusSq);
+    const float32x4_t worldX = vdupq_n_f32(width), halfX = vdupq_n_f32(width * 0.5f), minusHalfX = vdupq_n_f32(-width * 0.5f);
+    const float32x4_t worldY = vdupq_n_f32(height), halfY = vdupq_n_f32(height * 0.5f), minusHalfY = vdupq_n_f32(-height * 0.5f);
+    const float32x4_t zero = vdupq_n_f32(0.0f);
+    const float32x4_t one = vdupq_n_f32(1.0f);
+
+    float32x4_t separationX = zero, separationY = zero, separationCount = zero;
+    float32x4_t velocityX = zero, velocityY = zero;
+    float32x4_t positionX = zero, positionY = zero, neighborCount = zero;
+
+    // Load the lanes of one array for the four listed neighbors starting at j
+    auto gather = [](const float* data, const int* j) {
+        float32x4_t v = vdupq_n_f32(data[j[0]]);
+        v = vsetq_lane_f32(data[j[1]], v, 1);
+        v = vsetq_lane_f32(data[j[2]], v, 2);
+        return vsetq_lane_f32(data[j[3]], v, 3);
+    };
+
+    int e = begin;
+    for (; e + 4 <= end; e += 4) {
+        const int* j = entries + e;
+        float32x4_t dx = vsubq_f32(x, gather(arrays.px, j));
+        float32x4_t dy = vsubq_f32(y, gather(arrays.py, j));
+        dx = vsubq_f32(dx, maskLanes(vcgtq_f32(dx, halfX), worldX));  // Nearest image, as wrapDelta
+        dx = vaddq_f32(dx, maskLanes(vcltq_f32(dx, minusHalfX), worldX));
+        dy = vsubq_f32(dy, maskLanes(vcgtq_f32(dy, halfY), worldY));
+        dy = vaddq_f32(dy, maskLanes(vcltq_f32(dy, minusHalfY), worldY));
+        float32x4_t d2 = vmlaq_f32(vmulq_f32(dy, dy), dx, dx);
+
+        uint32x4_t isNeighbor = vandq_u32(vcgtq_f32(d2, zero), vcltq_f32(d2, neighborRadiusSq));
+
+        if constexpr ((Terms & TERM_VELOCITY) != 0) {
+            velocityX = vaddq_f32(velocityX, maskLanes(isNeighbor, gather(arrays.vx, j)));
+            velocityY = vaddq_f32(velocityY, maskLanes(isNeighbor, gather(arrays.vy, j)));
+        }
+        if constexpr ((Terms & TERM_POSITION) != 0) {
+            positionX = vaddq_f32(positionX, maskLanes(isNeighbor, vsubq_f32(x, dx)));
+            positionY = vaddq_f32(positionY, maskLanes(isNeighbor, vsubq_f32(y, dy)));
+        }
+        if constexpr ((Terms & (TERM_VELOCITY | TERM_POSITION)) != 0) {
+            neighborCount = vaddq_f32(neighborCount, maskLanes(isNeighbor, one));
+        }
+
+        if constexpr ((Terms & TERM_SEPARATION) != 0) {
+            uint32x4_t isClose = vandq_u32(isNeighbor, vcltq_f32(d2, separationRadiusSq));
+            float32x4_t inverse = vrecpeq_f32(d2);
+            inverse = vmulq_f32(inverse, vrecpsq_f32(d2, inverse));  // r' = r * (2 - d2 * r)
+            separationX = vaddq_f32(separationX, maskLanes(isClose, vmulq_f32(dx, inverse)));
+            separationY = vaddq_f32(separationY, maskLanes(isClose, vmulq_f32(dy, inverse)));
+            separationCount = vaddq_f32(separationCount, maskLanes(isClose, one));
+        }
+    }
+
+    if constexpr ((Terms & TERM_SEPARATION) != 0) {
+        sums.separationX += horizontalSum(separationX);
+        sums.separationY += horizontalSum(separationY);
+    }
+    if constexpr ((Terms & TERM_VELOCITY) != 0) {
+        sums.velocityX += horizontalSum(velocityX);
+        sums.velocityY += horizontalSum(velocityY);
+    }
+    if constexpr ((Terms & TERM_POSITION) != 0) {
+        sums.positionX += horizontalSum(positionX);
+        sums.positionY += horizontalSum(positionY);
+    }
+    if constexpr ((Terms & TERM_SEPARATION) != 0) sums.separationCount += (int)horizontalSum(separationCount);
+    if constexpr ((Terms & (TERM_VELOCITY | TERM_POSITION)) != 0) sums.neighborCount += (int)horizontalSum(neighborCount);
+
+    accumulateListScalar<Terms>(arrays, entries, e, end, query, width, height, sums);
+}
+
+// NEON compact kernel: vmovl widens four 16-bit lanes at a time (masked tails as in AVX2)
+template <unsigned Terms = TERMS_ALL>
+void accumulateCompactNEON(const CompactNeighborArrays& arrays, const int* cellStart, int firstCell, int lastCell, int begin, int end,
+                           const NeighborQuery& query, NeighborSums& sums) {
+    const float32x4_t x = vdupq_n_f32(query.x);
+    const float32x4_t y = vdupq_n_f32(query.y);
+    const float32x4_t separationRadiusSq = vdupq_n_f32(query.separationRadiusSq);
+    const float32x4_t neighborRadiusSq = vdupq_n_f32(query.neighborRadiusSq);
+    const float32x4_t selfDistanceSq = vdupq_n_f32(arrays.selfDistanceSq);
+    const float32x4_t zero = vdupq_n_f32(0.0f);
+    const float32x4_t one = vdupq_n_f32(1.0f);
+    const int32_t laneIndex[4] = { 0, 1, 2, 3 };
+    const int32x4_t lane = vld1q_s32(laneIndex);
+
+    float32x4_t separationX = zero, separationY = zero, separationCount = zero;
+    float32x4_t velocityX = zero, velocityY = zero;
+    float32x4_t positionX = zero, positionY = zero, neighborCount = zero;
+
+    for (int c = firstCell; c <= lastCell; c++) {
+        const float32x4_t cellX = vdupq_n_f32((c - firstCell) * arrays.cellWidth);  // Origin of this cell, relative to firstCell's
+        int cellEnd = std::min(end, cellStart[c + 1]);
+        for (int j = std::max(begin, cellStart[c]); j < cellEnd; j += 4) {
+            uint32x4_t inRange = vcgtq_s32(vdupq_n_s32(cellEnd - j), lane);  // Lanes before the cell's end
+            float32x4_t otherX = vmlaq_n_f32(cellX, vcvtq_f32_u32(vmovl_u16(vld1_u16(arrays.px + j))), arrays.positionScaleX);
+            float32x4_t otherY = vmulq_n_f32(vcvtq_f32_u32(vmovl_u16(vld1_u16(arrays.py + j))), arrays.positionScaleY);
+            float32x4_t dx = vsubq_f32(x, otherX);
+            float32x4_t dy = vsubq_f32(y, otherY);
+            float32x4_t d2 = vmlaq_f32(vmulq_f32(dy, dy), dx, dx);
+
+            uint32x4_t isNeighbor = vandq_u32(vandq_u32(vcgtq_f32(d2, selfDistanceSq), vcltq_f32(d2, neighborRadiusSq)), inRange);
+
+            if constexpr ((Terms & TERM_VELOCITY) != 0) {
+                float32x4_t otherVx = vcvtq_f32_s32(vmovl_s16(vld1_s16(arrays.vx + j)));  // Still in velocity units, scaled once after the loop
+                float32x4_t otherVy = vcvtq_f32_s32(vmovl_s16(vld1_s16(arrays.vy + j)));
+                velocityX = vaddq_f32(velocityX, maskLanes(isNeighbor, otherVx));
+                velocityY = vaddq_f32(velocityY, maskLanes(isNeighbor, otherVy));
+            }
+            if constexpr ((Terms & TERM_POSITION) != 0) {
+                positionX = vaddq_f32(positionX, maskLanes(isNeighbor, otherX));
+                positionY = vaddq_f32(positionY, maskLanes(isNeighbor, otherY));
+            }
+            if constexpr ((Terms & (TERM_VELOCITY | TERM_POSITION)) != 0) {
+                neighborCount = vaddq_f32(neighborCount, maskLanes(isNeighbor, one));
+            }
+
+            if constexpr ((Terms & TERM_SEPARATION) != 0) {
+                uint32x4_t isClose = vandq_u32(isNeighbor, vcltq_f32(d2, separationRadiusSq));
+                float32x4_t inverse = vrecpeq_f32(d2);
+                inverse = vmulq_f32(inverse, vrecpsq_f32(d2, inverse));  // r' = r * (2 - d2 * r)
+                separationX = vaddq_f32(separationX, maskLanes(isClose, vmulq_f32(dx, inverse)));
+                separationY = vaddq_f32(separationY, maskLanes(isClose, vmulq_f32(dy, inverse)));
+                separationCount = vaddq_f32(separationCount, maskLanes(isClose, one));
+            }
+        }
+    }
+
+    if constexpr ((Terms & TERM_SEPARATION) != 0) {
+        sums.separationX += horizontalSum(separationX);
+        sums.separationY += horizontalSum(separationY);
+    }
+    if constexpr ((Terms & TERM_VELOCITY) != 0) {
+        sums.velocityX += horizontalSum(vmulq_n_f32(velocityX, arrays.velocityScale));
+        sums.velocityY += horizontalSum(vmulq_n_f32(velocityY, arrays.velocityScale));
+    }
+    if constexpr ((Terms & TERM_POSITION) != 0) {
+        sums.positionX += horizontalSum(positionX);
+        sums.positionY += horizontalSum(positionY);
+    }
+    if constexpr ((Terms & TERM_SEPARATION) != 0) sums.separationCount += (int)horizontalSum(separationCount);
+    if constexpr ((Terms & (TERM_VELOCITY | TERM_POSITION)) != 0) sums.neighborCount += (int)horizontalSum(neighborCount);
+}
+#endif
+
+// The neighbor kernels of one instruction set, with its name
+struct NeighborKernelInfo {
+    const char* name;
+    NeighborKernel kernel;
+    NeighborListKernel listKernel;  // For Verlet lists
+    CompactNeighborKernel compactKernel;  // For grids in the compact layout
+};
+
+#if FLOCK_X86
+// True when the CPU and the OS both support AVX2 and FMA
+inline bool cpuSupportsAVX2() {
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    bool osSavesYmm = (info[2] & (1 << 27)) && ((_xgetbv(0) & 6) == 6);
+    bool fma = (info[2] & (1 << 12)) != 0;
+    __cpuidex(info, 7, 0);
+    return osSavesYmm && fma && (info[1] & (1 << 5));
+#else
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#endif
+}
+
+// True when the CPU supports SSE4.1
+inline bool cpuSupportsSSE4() {
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    return (info[2] & (1 << 19)) != 0;
+#else
+    return __builtin_cpu_supports("sse4.1");
+#endif
+}
+#endif
+
+// Pick the widest neighbor kernel this CPU can run, computing the given terms
+template <unsigned Terms = TERMS_ALL>
+inline NeighborKernelInfo detectNeighborKernel() {
+#if FLOCK_X86
+    if (cpuSupportsAVX2()) return { "AVX2", accumulateNeighborsAVX2<Terms>, accumulateListAVX2<Terms>, accumulateCompactAVX2<Terms> };
+    if (cpuSupportsSSE4()) return { "SSE4", accumulateNeighborsSSE4<Terms>, accumulateListSSE4<Terms>, accumulateCompactSSE4<Terms> };
+#elif FLOCK_NEON
+    return { "NEON", accumulateNeighborsNEON<Terms>, accumulateListNEON<Terms>, accumulateCompactNEON<Terms> };
+#endif
+    return { "scalar", accumulateNeighborsScalar<Terms>, accumulateListScalar<Terms>, accumulateCompactScalar<Terms> };
+}
+
+// Run of neighboring columns (or rows) of a cell, and the offset that moves the
+// boids in it to their nearest periodic image (0, or +/- the world size)
+struct NeighborRun {
+    int first, last;
+    float shift;
+};
+
+// The (at most three) neighbor runs of one column or row
+struct NeighborRuns {
+    NeighborRun runs[3];
+    int count;
+};
+
+// Uniform grid over the screen, rebuilt every frame, used to find nearby boids
+// without scanning the whole flock. Cells are at least as wide as the neighbor
+// radius, so every neighbor of a boid lies in the 3x3 block of cells around it.
+// The screen wraps around (see Boid::borders), so the block wraps too: the
+// columns and rows past an edge come from the other side, shifted by the world
+// size so distances are measured to the nearest image. These runs are
+// precomputed per column and row, which keeps edge cells as cheap as the others.
+// When built from a BoidSoA the grid also keeps a copy of the neighbor data in
+// cell order, so each run of a row is one contiguous range for the neighbor kernels,
+// and the position and velocity sums of every cell.
+// With a subdivision s > 1 the cells are s times smaller and the block grows to
+// (2s+1)x(2s+1) cells; cells of it that lie completely inside the neighbor radius
+// can then be accounted for by their sums instead of boid by boid.
+// In the compact layout the neighbor data is kept as 16-bit fixed point instead
+// (CompactNeighborArrays), which halves the bytes the neighbor kernels stream through.
+struct SpatialGrid {
+    // Position and velocity sums of the boids in a run of cells (double, as they are
+    // differences of running sums along a row)
+    struct CellSums {
+        double px, py;
+        double vx, vy;
+    };
+
+    float cellWidth, cellHeight;    // Size of a cell (the world is split into whole cells)
+    float width, height;            // Size of the wrapping world
+    int cols, rows;                 // Number of cells horizontally and vertically
+    int reach;                      // Cells searched on each side of a boid's cell (the subdivision)
+    std::vector<NeighborRuns> columnRuns;  // Neighbor columns of every column
+    std::vector<NeighborRuns> rowRuns;     // Neighbor rows of every row
+    std::vector<int> cellStart;     // Offset of each cell's first entry in cellEntries (cols*rows + 1 entries)
+    std::vector<int> cellEntries;   // Boid indices, grouped by cell
+    std::vector<int> boidCell;      // Cell of each boid (scratch used while building)
+    AlignedVector<float> sortedPx, sortedPy, sortedVx, sortedVy;  // Neighbor data in cellEntries order
+    static constexpr size_t COMPACT_PADDING = 8;  // Entries past the flock the compact kernels may read
+    bool compact = false;                 // Fill the compact arrays below instead of the sorted floats
+    AlignedVector<uint16_t> compactPx, compactPy;  // Position in the boid's cell, 0..65535 across the cell
+    AlignedVector<int16_t> compactVx, compactVy;   // Velocity, +/-32767 at the fastest component of the flock
+    float compactVelocityScale = 0.0f;    // Velocity per unit of compactVx/Vy
+    std::vector<CellSums> rowPrefixSums;  // Per row, the sums of its first 0..cols cells, filled by build(const BoidSoA&)
+    std::vector<int> aggregateOuter;      // Per row offset |dy|: cells with aggregateInner < |dx| <= aggregateOuter
+    std::vector<int> aggregateInner;      // can be taken from their sums (see setAggregateRadii)
+
+    // Constructor to split the given area into cells no smaller than the neighbor radius
+    // divided by subdivision
+    SpatialGrid(float neighborRadius, float width, float height, int subdivision = 1) {
+        this->width = width;
+        this->height = height;
+        reach = subdivision;
+        cols = std::max(1, (int)(width / neighborRadius)) * subdivision;   // As many whole cells as fit across
+        rows = std::max(1, (int)(height / neighborRadius)) * subdivision;
+        cellWidth = width / cols;
+        cellHeight = height / rows;
+        cellStart.assign(cols * rows + 1, 0);
+
+        columnRuns.resize(cols);
+        for (int c = 0; c < cols; c++) columnRuns[c] = neighborRuns(c, cols, width, reach);
+        rowRuns.resize(rows);
+        for (int r = 0; r < rows; r++) rowRuns[r] = neighborRuns(r, rows, height, reach);
+    }
+
+    // Neighbor runs of cell c out of count cells spanning size, reach cells to each side.
+    // If the world is a single neighbor radius across (count == reach) it is narrower
+    // than two radii and wrapped images are not searched.
+    static NeighborRuns neighborRuns(int c, int count, float size, int reach) {
+        NeighborRuns result = {};
+        result.runs[result.count++] = { std::max(c - reach, 0), std::min(c + reach, count - 1), 0.0f };
+        if (count > reach && c - reach < 0) result.runs[result.count++] = { count + c - reach, count - 1, -size };  // Last cells, seen across the near edge
+        if (count > reach && c + reach >= count) result.runs[result.count++] = { 0, c + reach - count, size };    // First cells, seen across the far edge
+        return result;
+    }
+
+    // Column (or row) of a coordinate, clamped so boids on the far edge land in the last cell
+    static int cellCoord(float v, float size, int count) {
+        int c = (int)(v / size);
+        return std::min(std::max(c, 0), count - 1);
+    }
+
+    int cellColumn(float x) const { return cellCoord(x, cellWidth, cols); }
+    int cellRow(float y) const { return cellCoord(y, cellHeight, rows); }
+
+    // Preallocate the per-boid arrays for count boids
+    void reserve(size_t count) {
+        boidCell.reserve(count);
+        cellEntries.reserve(count);
+        if (compact) {
+            compactPx.reserve(count + COMPACT_PADDING);
+            compactPy.reserve(count + COMPACT_PADDING);
+            compactVx.reserve(count + COMPACT_PADDING);
+            compactVy.reserve(count + COMPACT_PADDING);
+        } else {
+            sortedPx.reserve(count);
+            sortedPy.reserve(count);
+            sortedVx.reserve(count);
+            sortedVy.reserve(count);
+        }
+    }
+
+    // Rebuild the grid from the current boid positions
+    void build(const std::vector<Boid>& boids);
+    void build(const BoidSoA& boids);
+    void buildCompact(const BoidSoA& boids);
+
+    // Number of boids the neighbor search of a boid in each cell scans, its whole block
+    // of cells (the pair tests the kernels do). Used as the cost estimate for load balancing.
+    void blockCounts(std::vector<int>& counts) const {
+        counts.resize(cols * rows);
+        for (int y = 0; y < rows; y++) {
+            for (int x = 0; x < cols; x++) {
+                int total = 0;
+                for (int r = 0; r < rowRuns[y].count; r++) {
+                    for (int row = rowRuns[y].runs[r].first; row <= rowRuns[y].runs[r].last; row++) {
+                        for (int c = 0; c < columnRuns[x].count; c++) {
+                            const NeighborRun& run = columnRuns[x].runs[c];
+                            total += cellStart[row * cols + run.last + 1] - cellStart[row * cols + run.first];
+                        }
+                    }
+                }
+                counts[y * cols + x] = total;
+            }
+        }
+    }
+
+    // Rebuild the grid from count boids whose positions are given by positionOf(i) (counting sort by cell)
+    template <typename PositionOf>
+    void buildFrom(size_t count, PositionOf positionOf) {
+        int cellCount = cols * rows;
+        cellStart.assign(cellCount + 1, 0);
+        boidCell.resize(count);
+        cellEntries.resize(count);
+
+        // Count how many boids fall into each cell
+        for (size_t i = 0; i < count; i++) {
+            Vector2 position = positionOf(i);
+            int cell = cellRow(position.y) * cols + cellColumn(position.x);
+            boidCell[i] = cell;
+            cellStart[cell + 1]++;
+        }
+
+        // Prefix sum turns the counts into the start offset of each cell
+        for (int c = 0; c < cellCount; c++) {
+            cellStart[c + 1] += cellStart[c];
+        }
+
+        // Scatter the boid indices into their cells, using cellStart as a cursor
+        for (size_t i = 0; i < count; i++) {
+            cellEntries[cellStart[boidCell[i]]++] = (int)i;
+        }
+
+        // Each cursor now points at the start of the next cell, so shift them back by one cell
+        for (int c = cellCount; c > 0; c--) {
+            cellStart[c] = cellStart[c - 1];
+        }
+        cellStart[0] = 0;
+    }
+
+    // Call visit(begin, end, shift) for each run of the wrapped 3x3 block of cells around a
+    // position, where [begin, end) is a range of cellEntries and shift must be added to the
+    // positions in it
+    template <typename Visitor>
+    void forEachNeighborRange(Vector2 position, Visitor&& visit) const {
+        const NeighborRuns& xRuns = columnRuns[cellColumn(position.x)];
+        const NeighborRuns& yRuns = rowRuns[cellRow(position.y)];
+
+        for (int ry = 0; ry < yRuns.count; ry++) {
+            const NeighborRun& rowRun = yRuns.runs[ry];
+            for (int y = rowRun.first; y <= rowRun.last; y++) {
+                for (int rx = 0; rx < xRuns.count; rx++) {
+                    // The cells of one row are stored back to back, so a run of columns is a single range
+                    const NeighborRun& columnRun = xRuns.runs[rx];
+                    visit(cellStart[y * cols + columnRun.first], cellStart[y * cols + columnRun.last + 1], Vector2{ columnRun.shift, rowRun.shift });
+                }
+            }
+        }
+    }
+
+    // Call visit(firstCell, lastCell, shift) for the same runs as forEachNeighborRange, given
+    // as cells of one row
+    template <typename Visitor>
+    void forEachNeighborRun(Vector2 position, Visitor&& visit) const {
+        const NeighborRuns& xRuns = columnRuns[cellColumn(position.x)];
+        const NeighborRuns& yRuns = rowRuns[cellRow(position.y)];
+
+        for (int ry = 0; ry < yRuns.count; ry++) {
+            const NeighborRun& rowRun = yRuns.runs[ry];
+            for (int y = rowRun.first; y <= rowRun.last; y++) {
+                for (int rx = 0; rx < xRuns.count; rx++) {
+                    const NeighborRun& columnRun = xRuns.runs[rx];
+                    visit(y * cols + columnRun.first, y * cols + columnRun.last, Vector2{ columnRun.shift, rowRun.shift });
+                }
+            }
+        }
+    }
+
+    // Call visit(cell, shift) for every cell of the wrapped block around a position
+    template <typename Visitor>
+    void forEachNeighborCell(Vector2 position, Visitor&& visit) const {
+        const NeighborRuns& xRuns = columnRuns[cellColumn(position.x)];
+        const NeighborRuns& yRuns = rowRuns[cellRow(position.y)];
+
+        for (int ry = 0; ry < yRuns.count; ry++) {
+            const NeighborRun& rowRun = yRuns.runs[ry];
+            for (int y = rowRun.first; y <= rowRun.last; y++) {
+                for (int rx = 0; rx < xRuns.count; rx++) {
+                    const NeighborRun& columnRun = xRuns.runs[rx];
+                    for (int x = columnRun.first; x <= columnRun.last; x++) {
+                        visit(y * cols + x, Vector2{ columnRun.shift, rowRun.shift });
+                    }
+                }
+            }
+        }
+    }
+
+    // Mark, for each offset from a boid's cell, whether the cell there lies entirely inside
+    // the neighbor radius and outside the separation radius wherever in its cell the boid is
+    void setAggregateRadii(float neighborRadius, float separationRadius) {
+        aggregateOuter.assign(reach + 1, -1);
+        aggregateInner.assign(reach + 1, -1);
+        for (int dy = 0; dy <= reach; dy++) {
+            float farY = (dy + 1) * cellHeight, nearY = std::max(dy - 1, 0) * cellHeight;
+            for (int dx = 0; dx <= reach; dx++) {
+                float farX = (dx + 1) * cellWidth, nearX = std::max(dx - 1, 0) * cellWidth;
+                float near2 = nearX * nearX + nearY * nearY;
+                if (farX * farX + farY * farY < neighborRadius * neighborRadius) aggregateOuter[dy] = dx;
+                if (near2 < separationRadius * separationRadius || near2 == 0) aggregateInner[dy] = dx;
+            }
+        }
+    }
+
+    // Call visit(first, last, shiftX) for the wrapped pieces of the columns [first, last], which
+    // may run past either edge
+    template <typename Visitor>
+    void forEachColumnSegment(int first, int last, bool wrap, Visitor&& visit) const {
+        if (!wrap) {
+            first = std::max(first, 0);
+            last = std::min(last, cols - 1);
+            if (first <= last) visit(first, last, 0.0f);
+            return;
+        }
+        if (first < 0 && first <= last) {
+            visit(first + cols, std::min(last, -1) + cols, -width);  // Last columns, seen across the near edge
+            first = 0;
+        }
+        if (first > last) return;
+        if (last >= cols) {
+            if (first < cols) visit(first, cols - 1, 0.0f);
+            visit(std::max(first, cols) - cols, last - cols, width);  // First columns, seen across the far edge
+            return;
+        }
+        visit(first, last, 0.0f);
+    }
+
+    // Walk the wrapped block around a position like forEachNeighborRange, split by
+    // setAggregateRadii's marks: scan(row, first, last, shift) for each run of cells
+    // that needs its boids tested, aggregate(count, sums, shift) for each run that can
+    // be taken as a whole
+    template <typename Scan, typename Aggregate>
+    void forEachNeighborSplit(Vector2 position, Scan&& scan, Aggregate&& aggregate) const {
+        int column = cellColumn(position.x), row = cellRow(position.y);
+        bool wrapColumns = cols > reach, wrapRows = rows > reach;  // Same rule as neighborRuns
+        for (int dy = -reach; dy <= reach; dy++) {
+            int y = row + dy;
+            float shiftY = 0.0f;
+            if (y < 0 || y >= rows) {
+                if (!wrapRows) continue;
+                shiftY = y < 0 ? -height : height;
+                y += y < 0 ? rows : -rows;
+            }
+
+            auto scanColumns = [&](int first, int last) {
+                forEachColumnSegment(column + first, column + last, wrapColumns, [&](int f, int l, float shiftX) {
+                    scan(y, f, l, Vector2{ shiftX, shiftY });
+                });
+            };
+            auto sumColumns = [&](int first, int last) {
+                forEachColumnSegment(column + first, column + last, wrapColumns, [&](int f, int l, float shiftX) {
+                    int count = cellStart[y * cols + l + 1] - cellStart[y * cols + f];
+                    if (count == 0) return;
+                    const CellSums& upTo = rowPrefixSums[y * (cols + 1) + l + 1];
+                    const CellSums& before = rowPrefixSums[y * (cols + 1) + f];
+                    CellSums sums = { upTo.px - before.px, upTo.py - before.py, upTo.vx - before.vx, upTo.vy - before.vy };
+                    aggregate(count, sums, Vector2{ shiftX, shiftY });
+                });
+            };
+
+            // Columns with inner < |dx| <= outer are taken from their sums
+            int outer = aggregateOuter[dy < 0 ? -dy : dy], inner = aggregateInner[dy < 0 ? -dy : dy];
+            if (outer <= inner) {
+                scanColumns(-reach, reach);
+            } else if (inner < 0) {
+                scanColumns(-reach, -outer - 1);
+                sumColumns(-outer, outer);
+                scanColumns(outer + 1, reach);
+            } else {
+                scanColumns(-reach, -outer - 1);
+                sumColumns(-outer, -inner - 1);
+                scanColumns(-inner, inner);
+                sumColumns(inner + 1, outer);
+                scanColumns(outer + 1, reach);
+            }
+        }
+    }
+
+    // Call visit(index, shift) for every boid in the wrapped 3x3 block of cells around a position
+    template <typename Visitor>
+    void forEachNeighbor(Vector2 position, Visitor&& visit) const {
+        forEachNeighborRange(position, [&](int begin, int end, Vector2 shift) {
+            for (int e = begin; e < end; e++) {
+                visit(cellEntries[e], shift);
+            }
+        });
+    }
+
+    // Cell-ordered neighbor data, filled by build(const BoidSoA&)
+    NeighborArrays neighborArrays() const {
+        return { sortedPx.data(), sortedPy.data(), sortedVx.data(), sortedVy.data() };
+    }
+
+    // The same in the compact layout
+    CompactNeighborArrays compactArrays() const {
+        float unit = std::min(cellWidth, cellHeight) / 65535.0f;
+        return { compactPx.data(), compactPy.data(), compactVx.data(), compactVy.data(),
+                 cellWidth / 65535.0f, cellHeight / 65535.0f, compactVelocityScale, cellWidth, 0.25f * unit * unit };
+    }
+
+    // Origin (top left corner) of a cell
+    Vector2 cellOrigin(int cell) const {
+        return { (cell % cols) * cellWidth, (cell / cols) * cellHeight };
+    }
+
+    // 16-bit fixed point offset into a cell, with toUnits = 65535 / the cell size
+    static uint16_t compactOffset(float offset, float toUnits) {
+        return (uint16_t)std::min(std::max(offset * toUnits + 0.5f, 0.0f), 65535.0f);
+    }
+};
+
+// Verlet neighbor lists: for every boid, the boids that were within the neighbor radius
+// plus a skin margin when the lists were built, in flat CSR arrays (the neighbors of boid
+// i are entries[start[i]] to entries[start[i + 1] - 1]). As long as no boid has moved more
+// than half the skin since then, no pair can have closed the skin, so every neighbor
+// within the radius is still on the list and a step only walks the lists, keeping the
+// entries inside the exact radius. Distances are measured to the nearest periodic image.
+// The lists hold storage indices and are rebuilt whenever the storage changes.
+struct NeighborList {
+    SpatialGrid grid;               // Index the lists are built from, cells as wide as the list radius
+    float radius;                   // Neighbor radius plus the skin
+    float skin;
+    std::vector<int> start;         // Offset of each boid's list in entries (boids + 1 entries)
+    std::vector<int> entries;       // Storage indices of the listed neighbors
+    AlignedVector<float> builtX, builtY;         // Positions the lists were built at
+    std::vector<std::vector<int>> chunkEntries;  // Scratch: the lists of each build chunk
+    std::vector<int> scratchStart, scratchEntries, newIndex;  // Scratch for permute
+    AlignedVector<float> scratchX, scratchY;
+    bool stale = true;              // Storage changed since the last build
+    uint64_t builds = 0;            // Times the lists were built
+
+    NeighborList(float neighborRadius, float skin, float width, float height)
+        : grid(neighborRadius + skin, width, height), radius(neighborRadius + skin), skin(skin) {}
+
+    // Whether lists fit the config: the world must be at least two list radii across, or
+    // the build grid would skip the wrapped images
+    static bool fits(const SimConfig& config) {
+        float listRadius = config.neighborRadius + config.verletSkin;
+        return config.verletSkin > 0 && config.screenWidth >= 2 * listRadius && config.screenHeight >= 2 * listRadius;
+    }
+
+    // True if the lists can't be used for the boids any more
+    bool needsRebuild(const BoidSoA& boids) const {
+        if (stale || start.size() != boids.size() + 1) return true;
+        float limitSq = skin * skin * 0.25f;
+        for (size_t i = 0; i < boids.size(); i++) {
+            float dx = wrapDelta(boids.px[i] - builtX[i], grid.width), dy = wrapDelta(boids.py[i] - builtY[i], grid.height);
+            if (dx * dx + dy * dy > limitSq) return true;
+        }
+        return false;
+    }
+
+    // Rebuild the lists from the current positions, chunkSize boids per task of the pool
+    void build(const BoidSoA& boids, ThreadPool& pool, size_t chunkSize);
+
+    // Follow the storage into a new order, where boid e is the old boid order[e] (as
+    // BoidSoA::gather), so re-sorting the flock doesn't cost a rebuild
+    void permute(const std::vector<int>& order);
+
+    // Length of boid i's list (the neighbor tests its step costs)
+    int count(size_t i) const { return start[i + 1] - start[i]; }
+};
+
+// PCG32 random number generator (O'Neill's pcg32_random_r). Unlike raylib's
+// GetRandomValue it is seeded explicitly and owned by whoever uses it, so a seed
+// reproduces the same flock on every run and platform.
+struct Pcg32 {
+    uint64_t state = 0;
+    uint64_t increment = 1;  // Selects the stream, always odd
+
+    explicit Pcg32(uint64_t seed = 0, uint64_t stream = 0x14057b7ef767814fULL) {
+        increment = (stream << 1) | 1;
+        next();
+        state += seed;
+        next();
+    }
+
+    uint32_t next() {
+        uint64_t old = state;
+        state = old * 6364136223846793005ULL + increment;
+        uint32_t shifted = (uint32_t)(((old >> 18) ^ old) >> 27);
+        uint32_t rotation = (uint32_t)(old >> 59);
+        return (shifted >> rotation) | (shifted << ((32 - rotation) & 31));
+    }
+
+    // Uniform integer in [min, max], like GetRandomValue (rejection sampling, so unbiased)
+    int range(int min, int max) {
+        uint32_t span = (uint32_t)(max - min) + 1;
+        if (span == 0) return (int)next();  // The full 32-bit range
+        uint32_t limit = (0u - span) % span;  // 2^32 mod span values would favor the low results
+        uint32_t value;
+        do value = next(); while (value < limit);
+        return min + (int)(value % span);
+    }
+};
+
+// A seed for runs that didn't ask for one, from the clock
+inline int clockSeed() {
+    uint64_t ticks = (uint64_t)std::chrono::high_resolution_clock::now().time_since_epoch().count();
+    ticks = (ticks ^ (ticks >> 31)) * 0x9E3779B97F4A7C15ULL;
+    return (int)((ticks >> 33) % 2147483646) + 1;  // A valid, nonzero seed setting
+}
+
+// Vector math of the steering code, passed as a template parameter. PreciseMath is
+// raylib's (Vector2Normalize/Vector2Length), so code using it gives the same bits as
+// before; it is what the validator's reference and the default step run.
+struct PreciseMath {
+    static Vector2 normalize(Vector2 v) { return Vector2Normalize(v); }
+
+    // v shortened to a length of at most limit
+    static Vector2 clampLength(Vector2 v, float limit) {
+        if (Vector2Length(v) > limit) return Vector2Scale(Vector2Normalize(v), limit);
+        return v;
+    }
+
+    static bool hasLength(Vector2 v) { return Vector2Length(v) > 0; }
+};
+
+// FastMath compares squared lengths and scales by a reciprocal square root estimate
+// refined by one Newton step (about 1e-7 relative error) instead of a square root and a
+// division. The flock follows the same rules, but its bits differ from PreciseMath's.
+struct FastMath {
+    static float rsqrt(float x) {
+#if FLOCK_X86
+        float r = _mm_cvtss_f32(_mm_rsqrt_ss(_mm_set_ss(x)));
+#elif FLOCK_NEON
+        float r = vget_lane_f32(vrsqrte_f32(vdup_n_f32(x)), 0);
+#else
+        return 1.0f / sqrtf(x);
+#endif
+#if FLOCK_X86 || FLOCK_NEON
+        return r * (1.5f - 0.5f * x * r * r);  // r' = r * (3 - x * r^2) / 2
+#endif
+    }
+
+    static Vector2 normalize(Vector2 v) {
+        float lengthSq = v.x * v.x + v.y * v.y;
+        if (lengthSq == 0.0f) return v;
+        float inverse = rsqrt(lengthSq);
+        return { v.x * inverse, v.y * inverse };
+    }
+
+    static Vector2 clampLength(Vector2 v, float limit) {
+        float lengthSq = v.x * v.x + v.y * v.y;
+        if (lengthSq <= limit * limit) return v;
+        float scale = rsqrt(lengthSq) * limit;
+        return { v.x * scale, v.y * scale };
+    }
+
+    static bool hasLength(Vector2 v) { return v.x * v.x + v.y * v.y > 0; }
+};
 
 // Boid structure, representing each individual boid
 struct Boid {
     Vector2 position;       // Position of the boid
     Vector2 velocity;       // Velocity of the boid
     Vector2 acceleration;   // Acceleration (used for force calculations)
-    float rotation;         // Rotation angle based on the boid's velocity
+    Vector2 heading;        // Unit vector along the boid's velocity, used for drawing
+
+    // Constructor to initialize a boid with a given position
+    Boid(Vector2 position, Pcg32& rng) {
+        this->position = position;
+        velocity = { (float)rng.range(-2, 2), (float)rng.range(-2, 2) };  // Random initial velocity
+        acceleration = { 0.0f, 0.0f };  // No initial acceleration
+        heading = headingOf(Vector2Normalize(velocity));  // Calculate the heading based on the initial velocity
+    }
+
+    // Constructor to restore a boid from stored state
+    Boid(Vector2 position, Vector2 velocity, Vector2 heading) {
+        this->position = position;
+        this->velocity = velocity;
+        acceleration = { 0.0f, 0.0f };
+        this->heading = heading;
+    }
+
+    // Heading for a normalized velocity; a boid that stands still faces +x, like atan2(0, 0) = 0 did
+    static Vector2 headingOf(Vector2 direction) {
+        if (direction.x == 0.0f && direction.y == 0.0f) return { 1.0f, 0.0f };
+        return direction;
+    }
+
+    // Update the boid's position based on its velocity and acceleration, over one
+    // simulation step (stepScale is 1 at the reference rate of 60 steps per second)
+    template <typename Math = PreciseMath>
+    void update(const SimConfig& config) {
+        float dt = config.stepScale();
+        velocity = Vector2Add(velocity, Vector2Scale(acceleration, dt));  // Add acceleration to velocity
+        Vector2 direction = Math::normalize(velocity);
+        velocity = Vector2Scale(direction, config.maxSpeed);  // Limit velocity to max speed
+        position = Vector2Add(position, Vector2Scale(velocity, dt));  // Update position based on velocity
+
+        acceleration = { 0.0f, 0.0f };  // Reset acceleration after each update
+        heading = headingOf(direction);  // The normalized velocity is the new heading, no trig needed
+    }
+
+    // Apply a force to the boid by adding it to its acceleration
+    void applyForce(Vector2 force) {
+        acceleration = Vector2Add(acceleration, force);  // Add the force to the acceleration
+    }
+
+    // Ensure the boid wraps around the screen edges
+    void borders(const SimConfig& config) {
+        if (position.x < 0) position.x = (float)config.screenWidth;   // Wrap around horizontally
+        if (position.x > config.screenWidth) position.x = 0;   // Wrap around horizontally
+        if (position.y < 0) position.y = (float)config.screenHeight;  // Wrap around vertically
+        if (position.y > config.screenHeight) position.y = 0;  // Wrap around vertically
+    }
+
+    // Separation behavior: steer away from nearby boids to avoid crowding
+    Vector2 separate(const std::vector<Boid>& boids, const SpatialGrid& grid, const SimConfig& config) const {
+        Vector2 steer = { 0.0f, 0.0f };  // Vector to store the steering force
+        int count = 0;
+
+        // Loop through the boids in nearby cells and check their distance to the current boid
+        grid.forEachNeighbor(position, [&](int index, Vector2 shift) {
+            Vector2 otherPosition = Vector2Add(boids[index].position, shift);  // Nearest image of the other boid
+            float d = Vector2Distance(position, otherPosition);
+            if (d > 0 && d < config.separationRadius) {  // If the boid is within the separation radius
+                Vector2 diff = Vector2Subtract(position, otherPosition);  // Vector pointing away from the other boid
+                diff = Vector2Normalize(diff);  // Normalize the vector
+                diff = Vector2Scale(diff, 1.0f / d);  // Scale by the inverse of the distance to add more force for closer boids
+                steer = Vector2Add(steer, diff);  // Add this force to the steering vector
+                count++;
+            }
+        });
+
+        // If there are nearby boids, average the steering forces
+        if (count > 0) {
+            steer = Vector2Scale(steer, 1.0f / (float)count);  // Normalize the force by the number of boids
+        }
+
+        // If there is any steering force, limit it to the maximum force
+        if (Vector2Length(steer) > 0) {
+            steer = Vector2Normalize(steer);  // Normalize the steering force
+            steer = Vector2Scale(steer, config.maxSpeed);  // Scale to maximum speed
+            steer = Vector2Subtract(steer, velocity);  // Subtract the current velocity to get the required force
+            if (Vector2Length(steer) > config.maxForce) {
+                steer = Vector2Scale(Vector2Normalize(steer), config.maxForce);  // Limit the force to the maximum force
+            }
+        }
+
+        return steer;  // Return the separation steering force
+    }
+
+    // Alignment behavior: steer towards the average velocity of nearby boids
+    Vector2 align(const std::vector<Boid>& boids, const SpatialGrid& grid, const SimConfig& config) const {
+        Vector2 sum = { 0.0f, 0.0f };  // Sum of the velocities of nearby boids
+        int count = 0;
+
+        // Loop through the boids in nearby cells and check their distance to the current boid
+        grid.forEachNeighbor(position, [&](int index, Vector2 shift) {
+            Vector2 otherPosition = Vector2Add(boids[index].position, shift);  // Nearest image of the other boid
+            float d = Vector2Distance(position, otherPosition);
+            if (d > 0 && d < config.neighborRadius) {  // If the boid is within the neighbor radius
+                sum = Vector2Add(sum, boids[index].velocity);  // Add the other boid's velocity to the sum
+                count++;
+            }
+        });
+
+        // If there are nearby boids, average the velocities
+        if (count > 0) {
+            sum = Vector2Scale(sum, 1.0f / (float)count);  // Average the velocities
+            sum = Vector2Normalize(sum);  // Normalize the average velocity
+            sum = Vector2Scale(sum, config.maxSpeed);  // Scale to the maximum speed
+            Vector2 steer = Vector2Subtract(sum, velocity);  // Steer towards the average velocity
+            if (Vector2Length(steer) > config.maxForce) {
+                steer = Vector2Scale(Vector2Normalize(steer), config.maxForce);  // Limit the steering force
+            }
+            return steer;  // Return the alignment steering force
+        }
+
+        return { 0.0f, 0.0f };  // No steering force if no nearby boids
+    }
+
+    // Cohesion behavior: steer towards the average position of nearby boids
+    Vector2 cohesion(const std::vector<Boid>& boids, const SpatialGrid& grid, const SimConfig& config) const {
+        Vector2 sum = { 0.0f, 0.0f };  // Sum of the positions of nearby boids
+        int count = 0;
+
+        // Loop through the boids in nearby cells and check their distance to the current boid
+        grid.forEachNeighbor(position, [&](int index, Vector2 shift) {
+            Vector2 otherPosition = Vector2Add(boids[index].position, shift);  // Nearest image of the other boid
+            float d = Vector2Distance(position, otherPosition);
+            if (d > 0 && d < config.neighborRadius) {  // If the boid is within the neighbor radius
+                sum = Vector2Add(sum, otherPosition);  // Add the other boid's position to the sum
+                count++;
+            }
+        });
+
+        // If there are nearby boids, average the positions
+        if (count > 0) {
+            sum = Vector2Scale(sum, 1.0f / (float)count);  // Average the positions
+            Vector2 steer = Vector2Subtract(sum, position);  // Steer towards the average position
+            steer = Vector2Normalize(steer);  // Normalize the steering vector
+            steer = Vector2Scale(steer, config.maxSpeed);  // Scale to maximum speed
+            steer = Vector2Subtract(steer, velocity);  // Subtract the current velocity to get the required force
+            if (Vector2Length(steer) > config.maxForce) {
+                steer = Vector2Scale(Vector2Normalize(steer), config.maxForce);  // Limit the force to the maximum force
+            }
+            return steer;  // Return the cohesion steering force
+        }
+
+        return { 0.0f, 0.0f };  // No steering force if no nearby boids
+    }
+
+    // Steer towards a desired direction at maximum speed, limited to the maximum force
+    template <typename Math = PreciseMath>
+    Vector2 steerTowards(Vector2 direction, const SimConfig& config) const {
+        Vector2 steer = Vector2Scale(Math::normalize(direction), config.maxSpeed);  // Desired velocity
+        steer = Vector2Subtract(steer, velocity);  // Subtract the current velocity to get the required force
+        return Math::clampLength(steer, config.maxForce);  // Limit the force to the maximum force
+    }
+
+    // Combined flocking force of FlockBehaviors (separation, alignment and cohesion)
+    template <typename Math = PreciseMath>
+    Vector2 flock(const SpatialGrid& grid, const NeighborKernelInfo& kernels, const SimConfig& config) const;
+
+    // The same force with the neighbors taken from the Verlet list of boid i of boids (this boid)
+    template <typename Math = PreciseMath>
+    Vector2 flock(const NeighborList& list, size_t i, const BoidSoA& boids, NeighborListKernel kernel, const SimConfig& config) const;
+
+    // Combined force of a behavior pipeline from a Verlet list, which replaces the grid
+    // search (so the neighbor cap and cell sums don't apply). The kernel must compute
+    // Pipeline::terms.
+    template <typename Pipeline, typename Math = PreciseMath>
+    Vector2 flockWith(const NeighborList& list, size_t i, const BoidSoA& boids, NeighborListKernel kernel, const SimConfig& config) const {
+        NeighborSums sums;
+        if constexpr (Pipeline::terms != 0) {
+            NeighborQuery query = { position.x, position.y, config.separationRadius * config.separationRadius, config.neighborRadius * config.neighborRadius };
+            NeighborArrays arrays = { boids.px.data(), boids.py.data(), boids.vx.data(), boids.vy.data() };
+            kernel(arrays, list.entries.data(), list.start[i], list.start[i + 1], query, list.grid.width, list.grid.height, sums);
+        }
+        return Pipeline::template steer<Math>(*this, sums, config);
+    }
+
+    // Combined force of a behavior pipeline, with the neighbor terms it needs computed in a
+    // single pass over the neighbors. Follows the same rules as separate/align/cohesion
+    // (kept as the reference implementation), but compares squared distances so no square
+    // root is needed per neighbor. The neighbor loop itself is one of the given kernels, which
+    // must compute Pipeline::terms, run over the grid's cell-ordered copy of the flock, once per
+    // wrapped run (or once per cell in the compact layout, whose positions are relative to their
+    // cell). Math is the vector math of the steering (PreciseMath or FastMath).
+    template <typename Pipeline, typename Math = PreciseMath>
+    Vector2 flockWith(const SpatialGrid& grid, const NeighborKernelInfo& kernels, const SimConfig& config) const {
+        if constexpr (Pipeline::terms == 0) return Pipeline::template steer<Math>(*this, NeighborSums(), config);  // No neighbor loop at all
+
+        NeighborQuery query = { position.x, position.y, config.separationRadius * config.separationRadius, config.neighborRadius * config.neighborRadius };
+        NeighborKernel kernel = kernels.kernel;
+        NeighborArrays arrays = grid.neighborArrays();
+        CompactNeighborArrays compactArrays = grid.compactArrays();
+        NeighborSums sums;
+
+        auto accumulate = [&](int begin, int end, Vector2 shift) {
+            // Measuring from position - shift is the same as moving the run by +shift. The
+            // kernel sums unshifted positions, so the shift of every counted neighbor is added after.
+            NeighborQuery shifted = query;
+            shifted.x -= shift.x;
+            shifted.y -= shift.y;
+            int counted = sums.neighborCount;
+            kernel(arrays, begin, end, shifted, sums);
+            counted = sums.neighborCount - counted;
+            sums.positionX += shift.x * counted;
+            sums.positionY += shift.y * counted;
+        };
+
+        // In the compact layout the query position is quantized the same way as the entries, so
+        // that the boid's own entry is (within rounding) at distance 0 and skipped, as it is in
+        // the float layout
+        Vector2 ownOrigin = { 0.0f, 0.0f }, ownOffset = { 0.0f, 0.0f };
+        if (grid.compact) {
+            ownOrigin = grid.cellOrigin(grid.cellRow(position.y) * grid.cols + grid.cellColumn(position.x));
+            ownOffset.x = (float)SpatialGrid::compactOffset(position.x - ownOrigin.x, 65535.0f / grid.cellWidth) * compactArrays.positionScaleX;
+            ownOffset.y = (float)SpatialGrid::compactOffset(position.y - ownOrigin.y, 65535.0f / grid.cellHeight) * compactArrays.positionScaleY;
+        }
+
+        // Entries [begin, end) of the cells [firstCell, lastCell] of a row. In the compact layout
+        // the query is moved into the frame of the first cell's (shifted) origin and the origin
+        // added back to the counted positions.
+        auto accumulateCells = [&](int firstCell, int lastCell, int begin, int end, Vector2 shift) {
+            if (!grid.compact) {
+                accumulate(begin, end, shift);
+                return;
+            }
+            Vector2 origin = Vector2Add(grid.cellOrigin(firstCell), shift);
+            NeighborQuery local = query;
+            local.x = ownOffset.x + (ownOrigin.x - origin.x);
+            local.y = ownOffset.y + (ownOrigin.y - origin.y);
+            int counted = sums.neighborCount;
+            kernels.compactKernel(compactArrays, grid.cellStart.data(), firstCell, lastCell, begin, end, local, sums);
+            counted = sums.neighborCount - counted;
+            sums.positionX += origin.x * counted;
+            sums.positionY += origin.y * counted;
+        };
+
+        int cap = config.maxNeighborsPerCell;
+        if (cap == 0 && !config.cellAggregates) {
+            if (grid.compact) {
+                grid.forEachNeighborRun(position, [&](int firstCell, int lastCell, Vector2 shift) {
+                    accumulateCells(firstCell, lastCell, grid.cellStart[firstCell], grid.cellStart[lastCell + 1], shift);
+                });
+            } else {
+                grid.forEachNeighborRange(position, accumulate);
+            }
+            return Pipeline::template steer<Math>(*this, sums, config);
+        }
+
+        // Capped: take a window of at most cap entries from each cell, so a step costs at
+        // most (2s+1)^2 * cap neighbor tests per boid however dense the flock is. Boids are in no
+        // particular order inside a cell, so the window is a sample of it; its start varies
+        // per boid and cell so that boids in the same cell don't all see the same sample.
+        // The averages come from the sample; the separation push is averaged too, so both need no rescaling.
+        uint32_t positionBits[2];
+        memcpy(positionBits, &position, sizeof(positionBits));
+        uint32_t seed = positionBits[0] * 0x9E3779B1u ^ positionBits[1] * 0x85EBCA77u;
+        auto sample = [&](int cell, Vector2 shift) {
+            int begin = grid.cellStart[cell];
+            int count = grid.cellStart[cell + 1] - begin;
+            if (count <= cap) {
+                accumulateCells(cell, cell, begin, begin + count, shift);
+                return;
+            }
+            int start = (int)((seed ^ (uint32_t)cell * 0xC2B2AE3Du) % (uint32_t)count);
+            accumulateCells(cell, cell, begin + start, begin + std::min(start + cap, count), shift);
+            if (start + cap > count) accumulateCells(cell, cell, begin, begin + start + cap - count, shift);  // Window wraps to the cell's start
+        };
+
+        if (!config.cellAggregates) {
+            grid.forEachNeighborCell(position, sample);
+            return Pipeline::template steer<Math>(*this, sums, config);
+        }
+
+        // With cell sums: the cells the grid marks as entirely inside the neighbor radius and
+        // outside the separation radius only add to the alignment and cohesion sums, so their
+        // precomputed sums stand in for their boids. The result is the same as scanning them.
+        grid.forEachNeighborSplit(position,
+            [&](int row, int first, int last, Vector2 shift) {  // Cells to scan
+                if (cap == 0) {
+                    accumulateCells(row * grid.cols + first, row * grid.cols + last, grid.cellStart[row * grid.cols + first], grid.cellStart[row * grid.cols + last + 1], shift);
+                } else {
+                    for (int x = first; x <= last; x++) sample(row * grid.cols + x, shift);
+                }
+            },
+            [&](int count, const SpatialGrid::CellSums& cellSums, Vector2 shift) {  // Cells taken from their sums
+                sums.velocityX += (float)cellSums.vx;
+                sums.velocityY += (float)cellSums.vy;
+                sums.positionX += (float)cellSums.px + shift.x * count;
+                sums.positionY += (float)cellSums.py + shift.y * count;
+                sums.neighborCount += count;
+            });
+        return Pipeline::template steer<Math>(*this, sums, config);
+    }
+
+    // Draw the boid on the screen as a triangle (representing the boid)
+    void draw() const {
+        drawAt(position, heading);
+    }
+
+    // Draw a boid triangle at a position, pointing along a unit heading. The wings are the
+    // heading rotated by +/-60 degrees, so the shape needs no per-boid trig.
+    static void drawAt(Vector2 position, Vector2 heading) {
+        const float wingCos = 0.5f;             // cos(PI / 3)
+        const float wingSin = 0.86602540378f;   // sin(PI / 3)
+        Vector2 front = { position.x + heading.x * 10, position.y + heading.y * 10 };  // Front of the boid
+        Vector2 left = { position.x + (heading.x * wingCos - heading.y * wingSin) * 6, position.y + (heading.x * wingSin + heading.y * wingCos) * 6 };  // Left wing
+        Vector2 right = { position.x + (heading.x * wingCos + heading.y * wingSin) * 6, position.y + (heading.y * wingCos - heading.x * wingSin) * 6 };  // Right wing
+
+        // Draw the boid using three triangles (body + two wings)
+        DrawTriangle(position, front, left, BLUE);
+        DrawTriangle(position, front, right, BLUE);
+    }
+};
+
+// Flocking behaviors that can be combined into a BehaviorPipeline. A behavior declares the
+// neighbor terms it reads (NeighborTerm flags) and turns the accumulated sums into its
+// weighted steering force. Behaviors without neighbor terms (goal seeking, obstacles,
+// fleeing a predator) add no work to the neighbor loop.
+struct SeparationBehavior {
+    static constexpr unsigned terms = TERM_SEPARATION;
+
+    // Steer along the average push away from the boids inside the separation radius
+    template <typename Math = PreciseMath>
+    static Vector2 steer(const Boid& boid, const NeighborSums& sums, const SimConfig& config) {
+        Vector2 separation = { sums.separationX, sums.separationY };
+        if (sums.separationCount > 0) {
+            separation = Vector2Scale(separation, 1.0f / (float)sums.separationCount);
+        }
+        if (Math::hasLength(separation)) {
+            return Vector2Scale(boid.steerTowards<Math>(separation, config), config.separationWeight);
+        }
+        return { 0.0f, 0.0f };
+    }
+};
+
+struct AlignmentBehavior {
+    static constexpr unsigned terms = TERM_VELOCITY;
+
+    // Steer towards the average velocity of the neighbors
+    template <typename Math = PreciseMath>
+    static Vector2 steer(const Boid& boid, const NeighborSums& sums, const SimConfig& config) {
+        if (sums.neighborCount == 0) return { 0.0f, 0.0f };
+        Vector2 averageVelocity = Vector2Scale({ sums.velocityX, sums.velocityY }, 1.0f / (float)sums.neighborCount);
+        return Vector2Scale(boid.steerTowards<Math>(averageVelocity, config), config.alignmentWeight);
+    }
+};
+
+struct CohesionBehavior {
+    static constexpr unsigned terms = TERM_POSITION;
+
+    // Steer towards the average position of the neighbors
+    template <typename Math = PreciseMath>
+    static Vector2 steer(const Boid& boid, const NeighborSums& sums, const SimConfig& config) {
+        if (sums.neighborCount == 0) return { 0.0f, 0.0f };
+        Vector2 averagePosition = Vector2Scale({ sums.positionX, sums.positionY }, 1.0f / (float)sums.neighborCount);
+        return Vector2Scale(boid.steerTowards<Math>(Vector2Subtract(averagePosition, boid.position), config), config.cohesionWeight);
+    }
+};
+
+// Behaviors combined at compile time: their neighbor terms are ORed into the set the
+// kernel computes, and their forces are added up in order
+template <typename... Behaviors>
+struct BehaviorPipeline {
+    static constexpr unsigned terms = (0u | ... | Behaviors::terms);
+
+    template <typename Math = PreciseMath>
+    static Vector2 steer(const Boid& boid, const NeighborSums& sums, const SimConfig& config) {
+        Vector2 force = { 0.0f, 0.0f };
+        ((force = Vector2Add(force, Behaviors::template steer<Math>(boid, sums, config))), ...);
+        return force;
+    }
+};
+
+// The behaviors the simulation runs. Add a behavior here to enable it; leaving it out
+// removes its code and its neighbor terms entirely.
+typedef BehaviorPipeline<SeparationBehavior, AlignmentBehavior, CohesionBehavior> FlockBehaviors;
+
+template <typename Math>
+Vector2 Boid::flock(const SpatialGrid& grid, const NeighborKernelInfo& kernels, const SimConfig& config) const {
+    return flockWith<FlockBehaviors, Math>(grid, kernels, config);
+}
+
+template <typename Math>
+Vector2 Boid::flock(const NeighborList& list, size_t i, const BoidSoA& boids, NeighborListKernel kernel, const SimConfig& config) const {
+    return flockWith<FlockBehaviors, Math>(list, i, boids, kernel, config);
+}
+
+// Rebuild the grid from the current boid positions
+void SpatialGrid::build(const std::vector<Boid>& boids) {
+    buildFrom(boids.size(), [&](size_t i) { return boids[i].position; });
+}
+
+void SpatialGrid::build(const BoidSoA& boids) {
+    buildFrom(boids.size(), [&](size_t i) { return Vector2{ boids.px[i], boids.py[i] }; });
+
+    if (compact) {
+        buildCompact(boids);
+    } else {
+        // Gather the neighbor data into cell order
+        sortedPx.resize(boids.size());
+        sortedPy.resize(boids.size());
+        sortedVx.resize(boids.size());
+        sortedVy.resize(boids.size());
+        for (size_t e = 0; e < cellEntries.size(); e++) {
+            int i = cellEntries[e];
+            sortedPx[e] = boids.px[i];
+            sortedPy[e] = boids.py[i];
+            sortedVx[e] = boids.vx[i];
+            sortedVy[e] = boids.vy[i];
+        }
+    }
+
+    // Running sums of the neighbor data along every row of cells
+    rowPrefixSums.resize(rows * (cols + 1));
+    for (int y = 0; y < rows; y++) {
+        CellSums sums = { 0.0, 0.0, 0.0, 0.0 };
+        rowPrefixSums[y * (cols + 1)] = sums;
+        for (int x = 0; x < cols; x++) {
+            int c = y * cols + x;
+            for (int e = cellStart[c]; e < cellStart[c + 1]; e++) {
+                int i = cellEntries[e];  // From the boids, so the sums are exact in the compact layout too
+                sums.px += boids.px[i];
+                sums.py += boids.py[i];
+                sums.vx += boids.vx[i];
+                sums.vy += boids.vy[i];
+            }
+            rowPrefixSums[y * (cols + 1) + x + 1] = sums;
+        }
+    }
+}
+
+// Encode the neighbor data into the compact layout, in cell order
+void SpatialGrid::buildCompact(const BoidSoA& boids) {
+    size_t n = boids.size();
+    compactPx.resize(n + COMPACT_PADDING);  // Zeros past the flock for the vector kernels' masked tails
+    compactPy.resize(n + COMPACT_PADDING);
+    compactVx.resize(n + COMPACT_PADDING);
+    compactVy.resize(n + COMPACT_PADDING);
+
+    float fastest = 1e-6f;  // Largest velocity component, which gets the full 16-bit range
+    for (size_t i = 0; i < n; i++) fastest = std::max(fastest, std::max(fabsf(boids.vx[i]), fabsf(boids.vy[i])));
+    compactVelocityScale = fastest / 32767.0f;
+    float toVelocity = 32767.0f / fastest;
+    float toX = 65535.0f / cellWidth, toY = 65535.0f / cellHeight;
+
+    for (int c = 0; c < cols * rows; c++) {
+        Vector2 origin = cellOrigin(c);
+        for (int e = cellStart[c]; e < cellStart[c + 1]; e++) {
+            int i = cellEntries[e];
+            compactPx[e] = compactOffset(boids.px[i] - origin.x, toX);
+            compactPy[e] = compactOffset(boids.py[i] - origin.y, toY);
+            compactVx[e] = (int16_t)lroundf(std::min(std::max(boids.vx[i] * toVelocity, -32767.0f), 32767.0f));
+            compactVy[e] = (int16_t)lroundf(std::min(std::max(boids.vy[i] * toVelocity, -32767.0f), 32767.0f));
+        }
+    }
+}
+
+void NeighborList::build(const BoidSoA& boids, ThreadPool& pool, size_t chunkSize) {
+    size_t n = boids.size();
+    grid.build(boids);
+    builtX.assign(boids.px.begin(), boids.px.end());
+    builtY.assign(boids.py.begin(), boids.py.end());
+    start.assign(n + 1, 0);
+
+    // Each chunk lists its boids into its own scratch, the counts go into start[i + 1]
+    chunkSize = std::max<size_t>(chunkSize, 1);
+    chunkEntries.resize((n + chunkSize - 1) / chunkSize);
+    float radiusSq = radius * radius;
+    pool.parallelFor(0, n, chunkSize, [&](size_t begin, size_t end) {
+        for (size_t first = begin; first < end; first += chunkSize) {  // The pool runs small loops as one range
+            std::vector<int>& list = chunkEntries[first / chunkSize];
+            size_t size = 0;
+            for (size_t i = first; i < std::min(first + chunkSize, end); i++) {
+                size_t before = size;
+                float x = boids.px[i], y = boids.py[i];
+                grid.forEachNeighborRange({ x, y }, [&](int rangeBegin, int rangeEnd, Vector2 shift) {
+                    if (list.size() < size + (rangeEnd - rangeBegin)) list.resize(2 * (size + (rangeEnd - rangeBegin)));
+                    int* out = list.data();
+                    for (int e = rangeBegin; e < rangeEnd; e++) {
+                        // Every entry is written, and kept by advancing past it (no branch to mispredict)
+                        float dx = x - shift.x - grid.sortedPx[e], dy = y - shift.y - grid.sortedPy[e];
+                        out[size] = grid.cellEntries[e];
+                        size += (dx * dx + dy * dy < radiusSq) & (grid.cellEntries[e] != (int)i);
+                    }
+                });
+                start[i + 1] = (int)(size - before);
+            }
+            list.resize(size);
+        }
+    });
+
+    for (size_t i = 0; i < n; i++) start[i + 1] += start[i];
+    entries.resize(start[n]);
+    pool.parallelFor(0, chunkEntries.size(), 1, [&](size_t begin, size_t end) {
+        for (size_t c = begin; c < end; c++) {
+            std::copy(chunkEntries[c].begin(), chunkEntries[c].end(), entries.begin() + start[c * chunkSize]);
+        }
+    });
+    stale = false;
+    builds++;
+}
+
+void NeighborList::permute(const std::vector<int>& order) {
+    size_t n = order.size();
+    newIndex.resize(n);
+    for (size_t e = 0; e < n; e++) newIndex[order[e]] = (int)e;
+    scratchStart.assign(n + 1, 0);
+    scratchEntries.resize(entries.size());
+    for (size_t e = 0; e < n; e++) {
+        int from = start[order[e]], count = start[order[e] + 1] - from;
+        scratchStart[e + 1] = scratchStart[e] + count;
+        for (int k = 0; k < count; k++) scratchEntries[scratchStart[e] + k] = newIndex[entries[from + k]];
+    }
+    start.swap(scratchStart);
+    entries.swap(scratchEntries);
+
+    scratchX.resize(n);
+    scratchY.resize(n);
+    for (size_t e = 0; e < n; e++) {
+        scratchX[e] = builtX[order[e]];
+        scratchY[e] = builtY[order[e]];
+    }
+    builtX.swap(scratchX);
+    builtY.swap(scratchY);
+}
+
+void BoidView::draw() const {
+    Boid::drawAt(position(), heading());
+}
+
+// Read the boid stored at index i
+Boid BoidSoA::get(size_t i) const {
+    return Boid({ px[i], py[i] }, { vx[i], vy[i] }, { hx[i], hy[i] });
+}
+
+// Store a boid at index i (its acceleration is not kept, it is reset after every update)
+void BoidSoA::set(size_t i, const Boid& boid) {
+    px[i] = boid.position.x;
+    py[i] = boid.position.y;
+    vx[i] = boid.velocity.x;
+    vy[i] = boid.velocity.y;
+    hx[i] = boid.heading.x;
+    hy[i] = boid.heading.y;
+}
+
+// Append a boid at the end of the storage
+void BoidSoA::push_back(const Boid& boid) {
+    resize(size() + 1);
+    set(size() - 1, boid);
+}
+
+// Stable reference to a boid. It stays valid while storage is re-sorted and other boids
+// come and go, and stops resolving once its boid is removed.
+struct BoidHandle {
+    uint32_t slot;
+    uint32_t generation;
+};
+
+// Identity bookkeeping for a flock whose storage is kept dense: removing a boid moves the
+// last one into its place, so the kernels never see holes. Each boid owns a slot from a
+// free list; the slot maps to the boid's current index and carries a generation that is
+// bumped when the boid is removed, which invalidates old handles to the slot. All arrays
+// are sized up front by reserve(), so adding and removing boids allocates nothing.
+struct BoidArena {
+    static constexpr uint32_t NO_INDEX = 0xFFFFFFFFu;
+
+    std::vector<uint32_t> slotOf;      // Slot of the boid at each index (the boid's stable id)
+    std::vector<uint32_t> indexOf;     // Index of the boid in each slot (NO_INDEX if free)
+    std::vector<uint32_t> generation;  // Generation of each slot
+    std::vector<uint32_t> freeSlots;   // Free slots, reused last-in first-out
+    std::vector<uint32_t> scratch;     // Used by permute
+
+    size_t size() const { return slotOf.size(); }
+    size_t capacity() const { return indexOf.size(); }
+
+    // Make room for count boids in total (the only call that allocates)
+    void reserve(size_t count) {
+        size_t old = capacity();
+        if (count <= old) return;
+        slotOf.reserve(count);
+        scratch.reserve(count);
+        indexOf.resize(count, NO_INDEX);
+        generation.resize(count, 0);
+        freeSlots.reserve(count);
+        for (size_t slot = count; slot-- > old;) freeSlots.push_back((uint32_t)slot);  // Lowest slot on top
+    }
+
+    // Register a boid appended at index size() (the caller appends its state)
+    BoidHandle add() {
+        if (freeSlots.empty()) reserve(std::max<size_t>(2 * capacity(), 16));
+        uint32_t slot = freeSlots.back();
+        freeSlots.pop_back();
+        indexOf[slot] = (uint32_t)slotOf.size();
+        slotOf.push_back(slot);
+        return { slot, generation[slot] };
+    }
+
+    // Unregister the boid at index i, where the caller moves the last boid's state
+    void removeAt(size_t i) {
+        uint32_t slot = slotOf[i];
+        uint32_t moved = slotOf.back();
+        slotOf[i] = moved;
+        indexOf[moved] = (uint32_t)i;
+        slotOf.pop_back();
+        indexOf[slot] = NO_INDEX;
+        generation[slot]++;
+        freeSlots.push_back(slot);
+    }
+
+    // Index of a handle's boid, or -1 if it has been removed
+    long resolve(BoidHandle handle) const {
+        if (handle.slot >= capacity() || generation[handle.slot] != handle.generation || indexOf[handle.slot] == NO_INDEX) return -1;
+        return (long)indexOf[handle.slot];
+    }
+
+    BoidHandle handleAt(size_t i) const { return { slotOf[i], generation[slotOf[i]] }; }
+
+    // Follow the storage being rearranged to new[e] = old[order[e]]
+    void permute(const std::vector<int>& order) {
+        scratch.resize(order.size());
+        for (size_t e = 0; e < order.size(); e++) scratch[e] = slotOf[order[e]];
+        slotOf.swap(scratch);
+        for (size_t e = 0; e < slotOf.size(); e++) indexOf[slotOf[e]] = (uint32_t)e;
+    }
+};
+
+// A change to the flock made in the window: spawn boids around a point, or remove all
+// boids within a radius of it
+struct FlockEdit {
+    Vector2 position;
+    int spawnCount;
+    float removeRadius;
+};
+
+// Checksum of a flock's state that doesn't depend on where each boid is stored: the
+// sum of a hash of every boid's id with the bits of its position and velocity. Flocks
+// with equal checksums are (barring a collision) bit-identical.
+inline uint64_t flockChecksum(const BoidSoA& boids, const uint32_t* ids) {
+    uint64_t sum = 0;
+    for (size_t i = 0; i < boids.size(); i++) {
+        float values[4] = { boids.px[i], boids.py[i], boids.vx[i], boids.vy[i] };
+        uint32_t bits[4];
+        memcpy(bits, values, sizeof(bits));
+        uint64_t hash = ids[i] * 0x9E3779B97F4A7C15ULL;
+        for (uint32_t b : bits) {
+            hash ^= b;
+            hash = (hash ^ (hash >> 30)) * 0xBF58476D1CE4E5B9ULL;  // splitmix64 finalizer
+            hash = (hash ^ (hash >> 27)) * 0x94D049BB133111EBULL;
+            hash ^= hash >> 31;
+        }
+        sum += hash;
+    }
+    return sum;
+}
+
+// Blend two consecutive frames of a flock, alpha = 0..1 of the way from previous to
+// current, for drawing between simulation steps. Boids that wrapped around an edge
+// during the step are drawn at their current position.
+void interpolateFlock(const BoidSoA& previous, const BoidSoA& current, float alpha, const SimConfig& config, BoidSoA& out) {
+    out.resize(current.size());
+    float halfWidth = config.screenWidth * 0.5f, halfHeight = config.screenHeight * 0.5f;
+    for (size_t i = 0; i < current.size(); i++) {
+        float dx = current.px[i] - previous.px[i];
+        float dy = current.py[i] - previous.py[i];
+        bool wrapped = fabsf(dx) > halfWidth || fabsf(dy) > halfHeight;
+        float t = wrapped ? 1.0f : alpha;
+        out.px[i] = current.px[i] - dx * (1.0f - t);
+        out.py[i] = current.py[i] - dy * (1.0f - t);
+        out.vx[i] = current.vx[i];
+        out.vy[i] = current.vy[i];
+        out.hx[i] = current.hx[i];
+        out.hy[i] = current.hy[i];
+    }
+}
+
+// Recording format (.flock). All sections start on 8-byte boundaries, so a mapped file
+// can be read in place:
+//   RecordFileHeader, then the SimConfig of the run as INI text (configBytes long)
+//   per frame: RecordFrameHeader, then one array per component, boidCount entries each:
+//     ids (uint32 BoidArena slots), then either px py vx vy hx hy (float32) or, with
+//     RECORD_QUANTIZED, px py (uint16, 0..65535 across the world) and hx hy (int16 unit
+//     heading * 32767). Velocities are not stored quantized: they are the heading times
+//     max_speed.
+const char RECORD_MAGIC[8] = { 'F', 'L', 'O', 'C', 'K', 'R', 'E', 'C' };
+const uint32_t RECORD_VERSION = 1;
+const uint32_t RECORD_QUANTIZED = 1;               // RecordFileHeader::flags
+const uint32_t RECORD_FRAME_MAGIC = 0x4d415246u;   // "FRAM"
+
+struct RecordFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t flags;
+    uint64_t frameCount;    // Written when the recording is closed (0 if it wasn't)
+    uint32_t configBytes;   // Length of the config text, before padding
+    uint32_t reserved;
+};
+
+struct RecordFrameHeader {
+    uint32_t magic;
+    uint32_t boidCount;
+    uint64_t step;          // Simulation step this frame is the result of
+    uint64_t bytes;         // Size of the frame including this header
+};
+
+inline size_t recordPadded(size_t bytes) { return (bytes + 7) & ~(size_t)7; }
+
+// Size of one frame of count boids
+inline size_t recordFrameBytes(size_t count, bool quantized) {
+    size_t arrays = quantized ? recordPadded(count * 4) + 4 * recordPadded(count * 2)
+                              : recordPadded(count * 4) + 6 * recordPadded(count * 4);
+    return sizeof(RecordFrameHeader) + arrays;
+}
+
+// Writes frames to a recording on a thread of its own. A frame is encoded into one page
+// and handed over while the writer thread writes the other page, so recording costs the
+// simulation one copy of the flock per frame. If the writer is still busy with the last
+// frame, the new one is dropped (and counted) rather than making the simulation wait.
+struct FrameRecorder {
+    FILE* file = nullptr;
+    bool quantized = false;
+    float width = 1.0f, height = 1.0f;      // World size, for quantizing positions
+    std::vector<uint8_t> filling;           // Page the simulation encodes into
+    std::vector<uint8_t> writing;           // Page the writer thread writes out
+    std::thread thread;
+    std::mutex mutex;                       // Guards writerBusy, stopping, failed and frameCount
+    std::condition_variable wake;           // Wakes the writer for a frame, and a blocking recorder when it is done
+    bool writerBusy = false;                // `writing` holds a frame not written yet
+    bool stopping = false;
+    bool failed = false;                    // A write failed (disk full?); later frames are discarded
+    bool blocking = false;                  // Wait for the writer instead of dropping frames (headless runs)
+    uint64_t frameCount = 0;                // Frames written to the file
+    uint64_t droppedFrames = 0;             // Frames skipped because the writer was behind
+
+    ~FrameRecorder() { close(); }
+
+    bool open(const char* path, const SimConfig& config, bool quantize) {
+        file = fopen(path, "wb");
+        if (!file) {
+            TraceLog(LOG_WARNING, "FLOCK: Failed to create recording %s", path);
+            return false;
+        }
+        quantized = quantize;
+        width = (float)config.screenWidth;
+        height = (float)config.screenHeight;
+
+        std::string text = config.toText();
+        RecordFileHeader header = {};
+        memcpy(header.magic, RECORD_MAGIC, sizeof(header.magic));
+        header.version = RECORD_VERSION;
+        header.flags = quantized ? RECORD_QUANTIZED : 0;
+        header.configBytes = (uint32_t)text.size();
+        text.resize(recordPadded(text.size()), '\n');
+        if (fwrite(&header, sizeof(header), 1, file) != 1 || fwrite(text.data(), 1, text.size(), file) != text.size() || fflush(file) != 0) {
+            TraceLog(LOG_WARNING, "FLOCK: Failed to write recording %s", path);
+            fclose(file);
+            file = nullptr;
+            return false;
+        }
+
+        thread = std::thread([this] { run(); });
+        return true;
+    }
+
+    bool isOpen() const { return file != nullptr; }
+
+    // Queue one frame (simulation thread)
+    void record(const BoidSoA& boids, const std::vector<uint32_t>& ids, uint64_t step) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            if (blocking) wake.wait(lock, [this] { return !writerBusy; });
+            if (failed) return;
+            if (writerBusy) {
+                droppedFrames++;
+                return;
+            }
+        }
+
+        size_t count = boids.size();
+        filling.resize(recordFrameBytes(count, quantized));  // Allocates only when the flock outgrows the page
+        RecordFrameHeader header = { RECORD_FRAME_MAGIC, (uint32_t)count, step, filling.size() };
+        uint8_t* out = filling.data();
+        memcpy(out, &header, sizeof(header));
+        out += sizeof(header);
+        memcpy(out, ids.data(), count * 4);
+        out += recordPadded(count * 4);
+        if (!quantized) {
+            for (const AlignedVector<float>* component : { &boids.px, &boids.py, &boids.vx, &boids.vy, &boids.hx, &boids.hy }) {
+                memcpy(out, component->data(), count * 4);
+                out += recordPadded(count * 4);
+            }
+        } else {
+            uint16_t* qx = (uint16_t*)out;
+            uint16_t* qy = (uint16_t*)(out + recordPadded(count * 2));
+            int16_t* qhx = (int16_t*)(out + 2 * recordPadded(count * 2));
+            int16_t* qhy = (int16_t*)(out + 3 * recordPadded(count * 2));
+            float scaleX = 65535.0f / width, scaleY = 65535.0f / height;
+            for (size_t i = 0; i < count; i++) {
+                qx[i] = (uint16_t)std::min(std::max(lroundf(boids.px[i] * scaleX), 0L), 65535L);
+                qy[i] = (uint16_t)std::min(std::max(lroundf(boids.py[i] * scaleY), 0L), 65535L);
+                qhx[i] = (int16_t)lroundf(boids.hx[i] * 32767.0f);
+                qhy[i] = (int16_t)lroundf(boids.hy[i] * 32767.0f);
+            }
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            filling.swap(writing);
+            writerBusy = true;
+        }
+        wake.notify_all();
+    }
+
+    // Write the queued frames, the frame count, and close the file; returns false if a write failed
+    bool close() {
+        if (!file) return true;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        thread.join();
+
+        // The header counts only the frames that made it to the file
+        bool ok = fseek(file, offsetof(RecordFileHeader, frameCount), SEEK_SET) == 0 &&
+            fwrite(&frameCount, sizeof(frameCount), 1, file) == 1;
+        ok = fclose(file) == 0 && ok && !failed;
+        file = nullptr;
+        if (!ok) TraceLog(LOG_WARNING, "FLOCK: Failed to write the recording, it holds %llu complete frames", (unsigned long long)frameCount);
+        if (droppedFrames > 0) TraceLog(LOG_WARNING, "FLOCK: Recording dropped %llu of %llu frames (disk too slow)", (unsigned long long)droppedFrames, (unsigned long long)(frameCount + droppedFrames));
+        return ok;
+    }
+
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            wake.wait(lock, [this] { return writerBusy || stopping; });
+            if (!writerBusy) return;  // Stopping with nothing left to write
+            lock.unlock();
+            bool written = !failed && fwrite(writing.data(), 1, writing.size(), file) == writing.size() && fflush(file) == 0;  // Flushed, so frameCount is on disk
+            lock.lock();
+            if (written) frameCount++;
+            else failed = true;
+            writerBusy = false;
+            wake.notify_all();
+        }
+    }
+};
+
+// Read-only view of a recording, mapped into memory. Frames are located once when the
+// file is opened; after that a frame is a set of pointers into the mapping, so unquantized
+// frames are replayed and drawn without copying.
+struct FrameReplay {
+    struct Frame {
+        uint32_t boidCount;
+        uint64_t step;
+        const uint32_t* ids;
+        const float *px, *py, *vx, *vy, *hx, *hy;   // Unquantized recordings
+        const uint16_t *qx, *qy;                    // Quantized recordings
+        const int16_t *qhx, *qhy;
+    };
+
+    const uint8_t* data = nullptr;
+    size_t size = 0;
+#if defined(_WIN32)
+    HANDLE fileHandle = INVALID_HANDLE_VALUE;
+    HANDLE mappingHandle = nullptr;
+#endif
+    SimConfig config;                   // Parameters the run was recorded with
+    bool quantized = false;
+    std::vector<size_t> frameOffsets;   // Offset of every frame in the file
+
+    ~FrameReplay() { close(); }
+
+    bool open(const char* path) {
+        if (!map(path)) {
+            TraceLog(LOG_WARNING, "FLOCK: Failed to map recording %s", path);
+            return false;
+        }
+        RecordFileHeader header;
+        if (size < sizeof(header)) return fail(path);
+        memcpy(&header, data, sizeof(header));
+        if (memcmp(header.magic, RECORD_MAGIC, sizeof(header.magic)) != 0 || header.version != RECORD_VERSION) return fail(path);
+        quantized = (header.flags & RECORD_QUANTIZED) != 0;
+
+        size_t offset = sizeof(header) + recordPadded(header.configBytes);
+        if (offset > size) return fail(path);
+        config.loadText(std::string((const char*)data + sizeof(header), header.configBytes), path);
+        config.sanitize();
+
+        // Walk the frames (a recording that wasn't closed has no frame count, but its complete frames are still read)
+        while (offset + sizeof(RecordFrameHeader) <= size) {
+            RecordFrameHeader frame;
+            memcpy(&frame, data + offset, sizeof(frame));
+            if (frame.magic != RECORD_FRAME_MAGIC || frame.bytes != recordFrameBytes(frame.boidCount, quantized) || offset + frame.bytes > size) break;
+            frameOffsets.push_back(offset);
+            offset += frame.bytes;
+        }
+        TraceLog(LOG_INFO, "FLOCK: Replaying %zu frames from %s", frameOffsets.size(), path);
+        return true;
+    }
+
+    size_t frameCount() const { return frameOffsets.size(); }
+
+    Frame frame(size_t index) const {
+        const uint8_t* in = data + frameOffsets[index];
+        RecordFrameHeader header;
+        memcpy(&header, in, sizeof(header));
+        size_t count = header.boidCount;
+        Frame frame = {};
+        frame.boidCount = header.boidCount;
+        frame.step = header.step;
+        in += sizeof(header);
+        frame.ids = (const uint32_t*)in;
+        in += recordPadded(count * 4);
+        if (!quantized) {
+            const float** components[6] = { &frame.px, &frame.py, &frame.vx, &frame.vy, &frame.hx, &frame.hy };
+            for (const float** component : components) {
+                *component = (const float*)in;
+                in += recordPadded(count * 4);
+            }
+        } else {
+            frame.qx = (const uint16_t*)in;
+            frame.qy = (const uint16_t*)(in + recordPadded(count * 2));
+            frame.qhx = (const int16_t*)(in + 2 * recordPadded(count * 2));
+            frame.qhy = (const int16_t*)(in + 3 * recordPadded(count * 2));
+        }
+        return frame;
+    }
+
+    // Copy (and dequantize) a frame into a flock
+    void decode(const Frame& frame, BoidSoA& boids) const {
+        boids.resize(frame.boidCount);
+        if (!quantized) {
+            size_t bytes = frame.boidCount * sizeof(float);
+            memcpy(boids.px.data(), frame.px, bytes);
+            memcpy(boids.py.data(), frame.py, bytes);
+            memcpy(boids.vx.data(), frame.vx, bytes);
+            memcpy(boids.vy.data(), frame.vy, bytes);
+            memcpy(boids.hx.data(), frame.hx, bytes);
+            memcpy(boids.hy.data(), frame.hy, bytes);
+            return;
+        }
+        float scaleX = config.screenWidth / 65535.0f, scaleY = config.screenHeight / 65535.0f;
+        for (size_t i = 0; i < frame.boidCount; i++) {
+            Vector2 heading = Boid::headingOf({ frame.qhx[i] / 32767.0f, frame.qhy[i] / 32767.0f });
+            boids.px[i] = frame.qx[i] * scaleX;
+            boids.py[i] = frame.qy[i] * scaleY;
+            boids.hx[i] = heading.x;
+            boids.hy[i] = heading.y;
+            boids.vx[i] = heading.x * config.maxSpeed;
+            boids.vy[i] = heading.y * config.maxSpeed;
+        }
+    }
+
+    void close() {
+        if (!data) return;
+#if defined(_WIN32)
+        UnmapViewOfFile(data);
+        CloseHandle(mappingHandle);
+        CloseHandle(fileHandle);
+#else
+        munmap((void*)data, size);
+#endif
+        data = nullptr;
+        size = 0;
+        frameOffsets.clear();
+    }
+
+private:
+    bool fail(const char* path) {
+        TraceLog(LOG_WARNING, "FLOCK: %s is not a flock recording", path);
+        close();
+        return false;
+    }
+
+    // Map the whole file read-only
+    bool map(const char* path) {
+#if defined(_WIN32)
+        fileHandle = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (fileHandle == INVALID_HANDLE_VALUE) return false;
+        LARGE_INTEGER fileSize;
+        if (!GetFileSizeEx(fileHandle, &fileSize) || fileSize.QuadPart == 0) {
+            CloseHandle(fileHandle);
+            return false;
+        }
+        mappingHandle = CreateFileMappingA(fileHandle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (!mappingHandle) {
+            CloseHandle(fileHandle);
+            return false;
+        }
+        data = (const uint8_t*)MapViewOfFile(mappingHandle, FILE_MAP_READ, 0, 0, 0);
+        if (!data) {
+            CloseHandle(mappingHandle);
+            CloseHandle(fileHandle);
+            return false;
+        }
+        size = (size_t)fileSize.QuadPart;
+        return true;
+#else
+        int fd = ::open(path, O_RDONLY);
+        if (fd < 0) return false;
+        struct stat info;
+        if (fstat(fd, &info) != 0 || info.st_size == 0) {
+            ::close(fd);
+            return false;
+        }
+        void* mapping = mmap(nullptr, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);  // The mapping keeps the file open
+        if (mapping == MAP_FAILED) return false;
+        madvise(mapping, (size_t)info.st_size, MADV_SEQUENTIAL);
+        data = (const uint8_t*)mapping;
+        size = (size_t)info.st_size;
+        return true;
+#endif
+    }
+};
+
+// Boundaries splitting the items 0..n, with prefix[i] the total cost of the first i items
+// (n + 1 entries), into one piece per share so that every piece costs about its share
+// of the total (shares sum to 1). Pieces are contiguous, in item order.
+inline void balancedSplits(const std::vector<double>& prefix, const std::vector<double>& shares, std::vector<size_t>& bounds) {
+    size_t n = prefix.size() - 1;
+    bounds.assign(1, 0);
+    double target = 0.0;
+    for (size_t k = 0; k + 1 < shares.size(); k++) {
+        target += shares[k] * prefix[n];
+        size_t split = std::lower_bound(prefix.begin(), prefix.end(), target) - prefix.begin();
+        bounds.push_back(std::min(std::max(split, bounds.back()), n));
+    }
+    bounds.push_back(n);
+}
+
+// How far the costliest piece of bounds is over its share: max cost / (share * total)
+inline double splitImbalance(const std::vector<double>& prefix, const std::vector<double>& shares, const std::vector<size_t>& bounds) {
+    double total = prefix.back(), worst = 0.0;
+    if (total <= 0.0) return 1.0;
+    for (size_t k = 0; k + 1 < bounds.size(); k++) {
+        worst = std::max(worst, (prefix[bounds[k + 1]] - prefix[bounds[k]]) / (shares[k] * total));
+    }
+    return worst;
+}
+
+// Flock simulation with double-buffered state. A step only reads frame N from
+// `current` and writes frame N+1 into `next`, so every boid sees the same
+// snapshot of its neighbors no matter in which order the boids are processed.
+// Together with the seeded generator this makes a run deterministic: the same
+// config (including the seed and the neighbor kernel) gives the same flock on
+// every step, whatever the thread count and chunk size.
+struct Simulation {
+    SimConfig config;                   // Parameters of the simulation
+    BoidSoA current;                    // State of frame N (read-only during a step)
+    BoidSoA next;                       // State of frame N+1 (written during a step)
+    SpatialGrid grid;                   // Spatial index over `current`, cells sized from the neighbor radius
+    std::unique_ptr<ThreadPool> pool;   // Threads that compute the boids of a step in parallel
+    NeighborKernelInfo kernel;          // Neighbor loop used by the step (widest SIMD the CPU has)
+    BoidArena arena;                    // Stable ids and handles of the boids in `current`/`next`
+    int stepsSinceReorder = 0;          // Steps since storage was last sorted into cell order
+    BoidSoA reordered;                  // Scratch storage for the re-sort
+    uint64_t stepCount = 0;             // Steps run so far
+    FrameRecorder* recorder = nullptr;  // Receives every finished frame, if set
+    Pcg32 rng;                          // Velocities and positions of new boids, seeded by config.seed
+    std::vector<size_t> chunkBounds;    // Load balanced chunks of the step, in storage order
+    std::vector<int> blockCounts;       // Scratch for the cost estimate
+    std::vector<double> costPrefix;
+    std::vector<double> chunkShares;
+    int stepsSinceBalance = 0;
+    Rectangle lodView;                  // Boids outside it coast for the longest interval (the whole world unless a camera sets it)
+    std::atomic<uint64_t> lodSkipped{ 0 };  // Flocking updates skipped by the LOD scheduler so far
+    std::unique_ptr<NeighborList> neighborList;  // Verlet lists, when verlet_skin is set (and fits the world)
+
+    // Constructor to create a flock of boids with random initial positions
+    Simulation(const SimConfig& config)
+        : config(config),
+          grid(config.neighborRadius, (float)config.screenWidth, (float)config.screenHeight, config.gridSubdivision),
+          pool(std::make_unique<ThreadPool>(config.numThreads)),
+          kernel(detectNeighborKernel<FlockBehaviors::terms>()) {
+        lodView = { 0.0f, 0.0f, (float)config.screenWidth, (float)config.screenHeight };
+        if (this->config.seed == 0) this->config.seed = clockSeed();
+        rng = Pcg32((uint64_t)this->config.seed);
+        TraceLog(LOG_INFO, "FLOCK: Neighbor kernel: %s, %d threads, seed %d", kernel.name, pool->threadCount(), this->config.seed);
+        grid.setAggregateRadii(config.neighborRadius, config.separationRadius);
+        grid.compact = config.compactNeighbors != 0;
+        reserve(std::max(config.boidCapacity, config.numBoids));
+        resizeFlock(config.numBoids);
+        updateNeighborList(SimConfig());
+    }
+
+    // Create, replace or drop the Verlet lists after a config change from old
+    void updateNeighborList(const SimConfig& old) {
+        if (!NeighborList::fits(config)) {
+            if (config.verletSkin > 0 && (neighborList || old.verletSkin != config.verletSkin)) {
+                TraceLog(LOG_WARNING, "FLOCK: verlet_skin %g needs a world at least two neighbor radii plus skins across, searching the grid", config.verletSkin);
+            }
+            neighborList.reset();
+        } else if (!neighborList || config.verletSkin != old.verletSkin || config.neighborRadius != old.neighborRadius ||
+                   config.screenWidth != old.screenWidth || config.screenHeight != old.screenHeight) {
+            neighborList = std::make_unique<NeighborList>(config.neighborRadius, config.verletSkin, (float)config.screenWidth, (float)config.screenHeight);
+            neighborList->grid.reserve(arena.capacity());
+        }
+    }
+
+    // Mark the Verlet lists out of date, after boids were added, removed or moved in storage
+    void invalidateNeighborList() {
+        if (neighborList) neighborList->stale = true;
+    }
+
+    // Preallocate the flock storage for count boids
+    void reserve(size_t count) {
+        arena.reserve(count);
+        current.reserve(count);
+        next.reserve(count);
+        reordered.reserve(count);
+        grid.reserve(count);
+    }
+
+    // Add a boid to both frames
+    BoidHandle spawn(const Boid& boid) {
+        if (arena.size() == arena.capacity()) reserve(std::max<size_t>(2 * arena.capacity(), 16));
+        current.push_back(boid);
+        next.push_back(boid);
+        invalidateNeighborList();
+        return arena.add();
+    }
+
+    // Remove the boid at index i from both frames (the last boid takes its index)
+    void despawnAt(size_t i) {
+        current.swapRemove(i);
+        next.swapRemove(i);
+        arena.removeAt(i);
+        invalidateNeighborList();
+    }
+
+    // Remove a boid by handle, returns false if it was already gone
+    bool despawn(BoidHandle handle) {
+        long i = arena.resolve(handle);
+        if (i < 0) return false;
+        despawnAt((size_t)i);
+        return true;
+    }
+
+    // Add boids at random positions, or drop the last ones, until the flock has count boids
+    void resizeFlock(int count) {
+        while ((int)current.size() < count) {
+            float x = (float)rng.range(0, config.screenWidth);
+            spawn(Boid({ x, (float)rng.range(0, config.screenHeight) }, rng));
+        }
+        while ((int)current.size() > count) despawnAt(current.size() - 1);
+        config.numBoids = count;
+    }
+
+    // Spawn and remove boids as asked by the window, between steps
+    void applyEdit(const FlockEdit& edit) {
+        for (int k = 0; k < edit.spawnCount; k++) {
+            float dx = (float)rng.range(-10, 10);
+            Vector2 position = { edit.position.x + dx, edit.position.y + rng.range(-10, 10) };
+            position.x = std::min(std::max(position.x, 0.0f), (float)config.screenWidth);
+            position.y = std::min(std::max(position.y, 0.0f), (float)config.screenHeight);
+            spawn(Boid(position, rng));
+        }
+        if (edit.removeRadius > 0) {
+            // Walking down, the boid swapped into a freed index has already been tested
+            float radiusSq = edit.removeRadius * edit.removeRadius;
+            for (size_t i = current.size(); i-- > 0;) {
+                float dx = current.px[i] - edit.position.x, dy = current.py[i] - edit.position.y;
+                if (dx * dx + dy * dy < radiusSq) despawnAt(i);
+            }
+        }
+        config.numBoids = (int)current.size();
+    }
+
+    // Sort the storage of both frames into the cell order of the grid just built from
+    // `current`, so boids that are close in space are close in memory. The grid's
+    // counting sort already is the permutation, and afterwards it is the identity.
+    void reorder() {
+        const std::vector<int>& order = grid.cellEntries;
+        reordered.gather(current, order);
+        std::swap(current, reordered);
+        reordered.gather(next, order);
+        std::swap(next, reordered);
+
+        arena.permute(order);
+
+        if (neighborList && !neighborList->stale && neighborList->start.size() == order.size() + 1) neighborList->permute(order);
+
+        for (size_t e = 0; e < grid.cellEntries.size(); e++) grid.cellEntries[e] = (int)e;  // The gathered neighbor data stays valid
+        stepsSinceReorder = 0;
+    }
+
+    // Switch to new parameters between steps. The grid and the thread pool are
+    // rebuilt only when the parameters they depend on change.
+    void setConfig(const SimConfig& newConfig) {
+        SimConfig old = config;
+        config = newConfig;
+
+        if (config.neighborRadius != old.neighborRadius || config.screenWidth != old.screenWidth || config.screenHeight != old.screenHeight ||
+            config.gridSubdivision != old.gridSubdivision || config.compactNeighbors != old.compactNeighbors) {
+            grid = SpatialGrid(config.neighborRadius, (float)config.screenWidth, (float)config.screenHeight, config.gridSubdivision);
+            grid.compact = config.compactNeighbors != 0;
+            grid.reserve(arena.capacity());
+        }
+        grid.setAggregateRadii(config.neighborRadius, config.separationRadius);
+        if (config.numThreads != old.numThreads) {
+            pool = std::make_unique<ThreadPool>(config.numThreads);
+        }
+        if (config.numBoids != old.numBoids) {  // Only on an explicit change; spawning and removing also move the count
+            resizeFlock(config.numBoids);
+        }
+        updateNeighborList(old);
+    }
+
+    // Compute frame N+1 for the boids in [begin, end) from frame N
+    void stepRange(size_t begin, size_t end) {
+        if (config.fastMath) stepRangeWith<FastMath>(begin, end);
+        else stepRangeWith<PreciseMath>(begin, end);
+    }
+
+    // stepRange with the given steering math (one pass per phase over the chunk, so each
+    // phase can be timed on its own)
+    template <typename Math>
+    void stepRangeWith(size_t begin, size_t end) {
+        thread_local std::vector<Boid> boids;  // The chunk between the passes
+        boids.clear();
+        {
+            PROFILE_SCOPE(PHASE_FORCES);
+            size_t skipped = 0;
+            for (size_t i = begin; i < end; i++) {
+                boids.push_back(current.get(i));
+                if (!lodDue(i)) {
+                    next.lastForce[i] = current.lastForce[i];  // Coasts this step
+                    skipped++;
+                    continue;
+                }
+                Vector2 force = neighborList ? boids.back().flock<Math>(*neighborList, i, current, kernel.listKernel, config)
+                                             : boids.back().flock<Math>(grid, kernel, config);  // Weighted separation + alignment + cohesion
+                boids.back().applyForce(force);
+                next.lastForce[i] = Vector2Length(force);
+            }
+            if (skipped > 0) lodSkipped += skipped;
+        }
+        {
+            PROFILE_SCOPE(PHASE_INTEGRATE);
+            for (Boid& boid : boids) boid.update<Math>(config);  // Update boid's position and velocity
+        }
+        {
+            PROFILE_SCOPE(PHASE_BORDERS);
+            for (size_t k = 0; k < boids.size(); k++) {
+                boids[k].borders(config);  // Ensure boid wraps around the screen edges
+                next.set(begin + k, boids[k]);
+            }
+        }
+    }
+
+    // Checksum of the current frame, see flockChecksum
+    uint64_t checksum() const {
+        return flockChecksum(current, arena.slotOf.data());
+    }
+
+    // Take over the flock of another simulation, so that both compute the same next step
+    void copyStateFrom(const BoidSoA& state, const BoidArena& ids, int reorderPhase, uint64_t steps) {
+        current = state;
+        next.resize(state.size());
+        arena = ids;
+        stepsSinceReorder = reorderPhase;
+        stepCount = steps;
+        invalidateNeighborList();
+    }
+
+    // Level of detail: whether boid i gets its flocking forces computed this step. A boid
+    // that skips them coasts on its velocity (dead reckoning), which is off by about its
+    // steering force per step; a boid whose last force was f may coast for lod_error / f
+    // steps (at most lod_interval, and that long outside lodView). New boids have no f yet
+    // (INFINITY), so in view they are updated right away. Intervals are powers of two, and
+    // every boid has its own phase, so the full updates spread evenly over the steps.
+    bool lodDue(size_t i) const {
+        if (config.lodInterval <= 1) return true;
+        int interval = config.lodInterval;
+        float x = current.px[i], y = current.py[i];
+        bool visible = x >= lodView.x && x <= lodView.x + lodView.width && y >= lodView.y && y <= lodView.y + lodView.height;
+        float drift = current.lastForce[i] * config.stepScale();  // Velocity error per coasted step
+        if (visible && drift * interval > config.lodError) interval = std::max((int)(config.lodError / drift), 1);
+        while (interval & (interval - 1)) interval &= interval - 1;  // Round down to a power of two
+        uint32_t phase = arena.slotOf[i] * 0x9E3779B1u >> 16;
+        return ((stepCount + phase) & (uint64_t)(interval - 1)) == 0;
+    }
+
+    // Blend the previous frame (left in `next` by the last step) towards the current one,
+    // alpha = 0..1 of the way, for drawing between simulation steps
+    void interpolate(float alpha, BoidSoA& out) const {
+        interpolateFlock(next, current, alpha, config, out);
+    }
+
+    // Split the step into chunks of about equal cost, a few per thread, so the threads
+    // that get the clumps of the flock don't finish last; the pool's work stealing evens
+    // out the rest. The cost of a boid is the number of boids its neighbor search scans
+    // (the length of its Verlet list, with lists). Chunks are only recomputed when they
+    // are off by more than balance_tolerance.
+    void balance(bool force) {
+        size_t n = current.size();
+        costPrefix.assign(n + 1, 0.0);
+        if (neighborList) {
+            for (size_t i = 0; i < n; i++) costPrefix[i + 1] = neighborList->count(i) + 8.0;  // Plus the fixed work of a boid (integrate, borders)
+        } else {
+            grid.blockCounts(blockCounts);
+            for (size_t c = 0; c + 1 < grid.cellStart.size(); c++) {
+                for (int e = grid.cellStart[c]; e < grid.cellStart[c + 1]; e++) {
+                    costPrefix[grid.cellEntries[e] + 1] = blockCounts[c] + 8.0;
+                }
+            }
+        }
+        for (size_t i = 0; i < n; i++) costPrefix[i + 1] += costPrefix[i];
+
+        size_t chunks = std::min<size_t>(std::max<size_t>(n / config.chunkSize, 1), 4 * pool->threadCount());
+        chunkShares.assign(chunks, 1.0 / chunks);
+        if (force || chunkBounds.size() != chunks + 1 || splitImbalance(costPrefix, chunkShares, chunkBounds) > 1.0 + config.balanceTolerance) {
+            balancedSplits(costPrefix, chunkShares, chunkBounds);
+        }
+        stepsSinceBalance = 0;
+    }
+
+    // Advance the whole flock by one simulation step
+    void step() {
+        bool moved = false;  // Storage was re-sorted or resized, so the chunks no longer fit
+        {
+            PROFILE_SCOPE(PHASE_GRID);
+            bool reorderDue = config.reorderInterval > 0 && ++stepsSinceReorder >= config.reorderInterval;
+            if (!neighborList || reorderDue) grid.build(current);  // Index the boids by cell for this frame (with lists only to re-sort)
+            if (reorderDue) {
+                reorder();
+                moved = true;
+            }
+            if (neighborList && neighborList->needsRebuild(current)) {
+                neighborList->build(current, *pool, config.chunkSize);
+                moved = true;  // The costs changed with the lists
+            }
+            moved = moved || chunkBounds.empty() || chunkBounds.back() != current.size();
+            if (config.balanceInterval > 0 && (moved || ++stepsSinceBalance >= config.balanceInterval)) balance(moved);
+        }
+        auto body = [this](size_t begin, size_t end) { stepRange(begin, end); };
+        if (config.balanceInterval > 0) pool->parallelForRanges(chunkBounds, body);
+        else pool->parallelFor(0, current.size(), config.chunkSize, body);
+        std::swap(current, next);  // Frame N+1 becomes the current frame
+        stepCount++;
+        if (recorder) recorder->record(current, arena.slotOf, stepCount);
+    }
+};
+
+// Checks a simulation backend step by step against the scalar reference. Before each
+// step the reference takes over the backend's flock and computes the same step with
+// the scalar kernel on one thread; the results are then compared boid by boid. The
+// reference restarts from the backend's state every step, so the errors measured are
+// those of a single step and don't grow with the chaos of the flock. The SIMD kernels
+// round differently (FMA, reciprocal estimates), so a boid almost exactly a radius
+// away can be a neighbor in one kernel and not in the other; a few boids per step may
+// differ by such a neighbor, a broken kernel makes many of them differ.
+struct StepValidator {
+    static constexpr float TOLERANCE = 1e-3f;            // Position or velocity difference that counts as a mismatch
+    static constexpr double MISMATCH_FRACTION = 1e-3;    // Share of compared boids allowed to mismatch
+
+    Simulation reference;
+    BoidSoA actual;                 // Scratch for backends that hand over a copy (the GPU)
+    uint64_t steps = 0;             // Steps compared
+    uint64_t exactSteps = 0;        // Steps whose results were bit-identical
+    uint64_t boidSteps = 0;         // Boids compared, over all steps
+    uint64_t mismatchedBoids = 0;   // Of those, the ones off by more than TOLERANCE
+    float maxPositionError = 0.0f;
+    float maxVelocityError = 0.0f;
+
+    explicit StepValidator(const SimConfig& config) : reference(referenceConfig(config)) {
+        reference.kernel = { "scalar", accumulateNeighborsScalar<FlockBehaviors::terms>, accumulateListScalar<FlockBehaviors::terms>,
+                             accumulateCompactScalar<FlockBehaviors::terms> };
+    }
+
+    static SimConfig referenceConfig(SimConfig config) {
+        config.numThreads = 1;
+        config.fastMath = 0;  // The reference is always precise, so fast_math is measured against it
+        config.numBoids = 0;  // The flock is copied in before every step
+        return config;
+    }
+
+    // Compute the reference result of the next step from a backend's state
+    void expect(const BoidSoA& state, const BoidArena& ids, int reorderPhase, uint64_t steps, const SimConfig& config) {
+        SimConfig stepConfig = referenceConfig(config);
+        stepConfig.numBoids = (int)state.size();
+        reference.copyStateFrom(state, ids, reorderPhase, steps);
+        reference.setConfig(stepConfig);
+        reference.step();
+    }
+
+    // Compare the backend's result of that step with the reference
+    void check(const BoidSoA& result) {
+        const BoidSoA& expected = reference.current;
+        steps++;
+        if (result.size() != expected.size()) {
+            maxPositionError = maxVelocityError = INFINITY;
+            return;
+        }
+        if (flockChecksum(result, reference.arena.slotOf.data()) == reference.checksum()) exactSteps++;
+        boidSteps += result.size();
+        for (size_t i = 0; i < result.size(); i++) {
+            // Measured on the torus, a boid wrapped at an edge by one and not the other is still close
+            float dx = fabsf(result.px[i] - expected.px[i]), dy = fabsf(result.py[i] - expected.py[i]);
+            dx = std::min(dx, fabsf(dx - reference.config.screenWidth));
+            dy = std::min(dy, fabsf(dy - reference.config.screenHeight));
+            float velocityError = std::max(fabsf(result.vx[i] - expected.vx[i]), fabsf(result.vy[i] - expected.vy[i]));
+            if (std::max(std::max(dx, dy), velocityError) > TOLERANCE) mismatchedBoids++;
+            maxPositionError = std::max(maxPositionError, std::max(dx, dy));
+            maxVelocityError = std::max(maxVelocityError, velocityError);
+        }
+    }
+
+    bool passed() const { return std::isfinite(maxPositionError) && mismatchedBoids <= boidSteps * MISMATCH_FRACTION; }
+};
+
+// A boid as sent between tiles, in world coordinates
+struct TileBoid {
+    float px, py, vx, vy;
+    uint32_t id;
+};
+
+// Moves boids between the tiles of a distributed run. A tile only talks to the tiles
+// left and right of it (wrapping around), one batch each way per step. With FLOCK_MPI
+// every rank is a tile; without it the run is a single tile whose batches come
+// straight back to itself, which exercises the same code paths.
+struct TileTransport {
+    enum { TO_LEFT = 0, TO_RIGHT = 1 };  // Direction a batch travels
+    int rank = 0;
+    int ranks = 1;
+#if defined(FLOCK_MPI)
+    MPI_Request pending[4];
+#endif
+
+    void init() {
+#if defined(FLOCK_MPI)
+        MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+        MPI_Comm_size(MPI_COMM_WORLD, &ranks);
+#endif
+    }
+
+    int left() const { return (rank + ranks - 1) % ranks; }
+    int right() const { return (rank + 1) % ranks; }
+
+    // Swap the sizes of this step's batches with the neighbors: counts[d] describes the
+    // batch sent in direction d, received[d] the one arriving in direction d (so
+    // received[TO_LEFT] comes from the right neighbor). Small, so it is not overlapped.
+    void exchangeCounts(const uint32_t (&counts)[2][2], uint32_t (&received)[2][2]) {
+#if defined(FLOCK_MPI)
+        MPI_Request requests[4];
+        MPI_Irecv(received[TO_LEFT], 2, MPI_UINT32_T, right(), TO_LEFT, MPI_COMM_WORLD, &requests[0]);
+        MPI_Irecv(received[TO_RIGHT], 2, MPI_UINT32_T, left(), TO_RIGHT, MPI_COMM_WORLD, &requests[1]);
+        MPI_Isend(counts[TO_LEFT], 2, MPI_UINT32_T, left(), TO_LEFT, MPI_COMM_WORLD, &requests[2]);
+        MPI_Isend(counts[TO_RIGHT], 2, MPI_UINT32_T, right(), TO_RIGHT, MPI_COMM_WORLD, &requests[3]);
+        MPI_Waitall(4, requests, MPI_STATUSES_IGNORE);
+#else
+        memcpy(received, counts, sizeof(received));
+#endif
+    }
+
+    // Start sending the batches and receiving the neighbors' ones into incoming, which
+    // must already have the sizes from exchangeCounts; finish() waits for both
+    void start(const std::vector<TileBoid> (&batches)[2], std::vector<TileBoid> (&incoming)[2]) {
+#if defined(FLOCK_MPI)
+        const int DATA_TAG = 2;  // After the count tags
+        MPI_Irecv(incoming[TO_LEFT].data(), (int)(incoming[TO_LEFT].size() * sizeof(TileBoid)), MPI_BYTE, right(), DATA_TAG + TO_LEFT, MPI_COMM_WORLD, &pending[0]);
+        MPI_Irecv(incoming[TO_RIGHT].data(), (int)(incoming[TO_RIGHT].size() * sizeof(TileBoid)), MPI_BYTE, left(), DATA_TAG + TO_RIGHT, MPI_COMM_WORLD, &pending[1]);
+        MPI_Isend(batches[TO_LEFT].data(), (int)(batches[TO_LEFT].size() * sizeof(TileBoid)), MPI_BYTE, left(), DATA_TAG + TO_LEFT, MPI_COMM_WORLD, &pending[2]);
+        MPI_Isend(batches[TO_RIGHT].data(), (int)(batches[TO_RIGHT].size() * sizeof(TileBoid)), MPI_BYTE, right(), DATA_TAG + TO_RIGHT, MPI_COMM_WORLD, &pending[3]);
+#else
+        incoming[TO_LEFT].assign(batches[TO_LEFT].begin(), batches[TO_LEFT].end());
+        incoming[TO_RIGHT].assign(batches[TO_RIGHT].begin(), batches[TO_RIGHT].end());
+#endif
+    }
+
+    void finish() {
+#if defined(FLOCK_MPI)
+        MPI_Waitall(4, pending, MPI_STATUSES_IGNORE);
+#endif
+    }
+
+    // Totals and maxima over all tiles
+    uint64_t sum(uint64_t value) const {
+#if defined(FLOCK_MPI)
+        uint64_t total;
+        MPI_Allreduce(&value, &total, 1, MPI_UINT64_T, MPI_SUM, MPI_COMM_WORLD);
+        return total;
+#else
+        return value;
+#endif
+    }
+
+    void sum(std::vector<double>& values) const {
+#if defined(FLOCK_MPI)
+        MPI_Allreduce(MPI_IN_PLACE, values.data(), (int)values.size(), MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+#else
+        (void)values;
+#endif
+    }
+
+    void max(std::vector<double>& values) const {
+#if defined(FLOCK_MPI)
+        MPI_Allreduce(MPI_IN_PLACE, values.data(), (int)values.size(), MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
+#else
+        (void)values;
+#endif
+    }
+};
+
+// One tile of a distributed run: the boids of the vertical strip x0 <= x < x1 of the
+// world (full height), stepped by the same grid and neighbor kernel as Simulation.
+// Boids are kept in the tile's local frame, which starts a halo width left of x0, so
+// the strip and its two halos form a small world of their own: x never wraps inside
+// it, and y wraps as in the whole world. A step:
+//   1. owned boids that left the strip are migrants for the neighbor on that side, and
+//      owned boids within a halo width of an edge are copied as its ghosts. Both go
+//      out in one batch per neighbor (the tile keeps its own migrants as ghosts for
+//      this step, as they are still within a halo width).
+//   2. while the batches are in flight, the interior boids, too far from the edges to
+//      see a ghost or a migrant coming in, are stepped from a grid of the owned boids.
+//   3. the migrants that came in join the owned boids, and the boids near the edges
+//      are stepped from a second grid over the edge bands and the ghosts.
+// The strips are made of columns a halo wide. Every balance_interval steps the tiles
+// move their boundaries along x so each one gets work in proportion to its speed
+// (see rebalance), which keeps a tile with a clump, or a slow node, from setting the
+// step time.
+struct TileDomain {
+    static constexpr int MIN_COLUMNS = 2;  // Narrowest strip: migrants and ghosts then only reach the next tile
+
+    SimConfig world;                    // Parameters of the run; the screen size is the world size
+    SimConfig local;                    // The same over the local frame
+    TileTransport transport;
+    float halo = 0;                     // Width of the halos and of a column, the neighbor radius rounded up
+    int columns = 0;                    // Columns across the world (the last one takes the remainder)
+    std::vector<size_t> splits;         // Column at which every tile's strip starts, plus `columns`
+    float x0 = 0, x1 = 0;               // Strip of the world owned by this tile
+    float margin = 0;                   // Boids closer than this to an edge may see ghosts or migrants
+    BoidSoA current, next;              // Owned boids, in the local frame
+    std::vector<uint32_t> ids;          // Global id of every owned boid
+    SpatialGrid grid;                   // Owned boids, for the interior
+    SpatialGrid bandGrid;               // Owned boids near the edges and the ghosts
+    BoidSoA band;                       // Contents of bandGrid
+    std::vector<int> bandOwner;         // Owned index of every band boid, -1 for ghosts
+    std::vector<size_t> interior, edge; // Owned boids stepped from grid and from bandGrid (band indices)
+    std::vector<TileBoid> batches[2], incoming[2];
+    uint32_t counts[2][2] = {}, received[2][2] = {};  // [direction][0 = migrants, 1 = ghosts]
+    std::unique_ptr<ThreadPool> pool;
+    NeighborKernelInfo kernel;
+    uint64_t ghostsSent = 0;            // Totals over the run, for the report
+    uint64_t migrantsSent = 0;
+    double computeSeconds = 0;          // Time spent stepping boids since the last balancing check
+    int stepsSinceBalance = 0;
+    int rebalances = 0;                 // Times the boundaries moved
+    double imbalance = 1.0;             // Of the split at the last balancing check
+    std::vector<int> blockCounts;       // Scratch for rebalance
+    std::vector<double> columnCosts, costPrefix, speeds;
+    std::vector<size_t> newSplits;
+
+    TileDomain(const SimConfig& config, const TileTransport& link)
+        : world(config), local(config), transport(link),
+          halo(ceilf(config.neighborRadius)),
+          grid(config.neighborRadius, 1.0f, 1.0f),
+          bandGrid(config.neighborRadius, 1.0f, 1.0f),
+          pool(std::make_unique<ThreadPool>(config.numThreads)),
+          kernel(detectNeighborKernel<FlockBehaviors::terms>()) {
+        margin = halo + config.maxSpeed * config.stepScale();  // A halo width plus how far a migrant gets into the strip
+        local.reorderInterval = 0;  // Storage order is managed here
+        columns = std::max((int)(config.screenWidth / halo), 1);
+        for (int k = 0; k <= transport.ranks; k++) splits.push_back((size_t)((int64_t)columns * k / transport.ranks));
+        setStrip(columnX(splits[transport.rank]), columnX(splits[transport.rank + 1]));
+    }
+
+    // True if the world can be cut into strips at least MIN_COLUMNS wide, and a boid moves less than a halo per step
+    static bool fits(const SimConfig& config, int ranks) {
+        float halo = ceilf(config.neighborRadius);
+        return (int)(config.screenWidth / halo) >= ranks * MIN_COLUMNS && config.maxSpeed * config.stepScale() < halo;
+    }
+
+    float columnX(size_t column) const { return (int)column >= columns ? (float)world.screenWidth : column * halo; }
+    float originX() const { return x0 - halo; }
+
+    // Own the strip x0..x1 from now on, moving the owned boids into its local frame
+    void setStrip(float newX0, float newX1) {
+        float shift = x0 - newX0;
+        for (float& x : current.px) x += shift;
+        x0 = newX0;
+        x1 = newX1;
+        local.screenWidth = (int)(x1 - x0 + 2 * halo);
+        grid = SpatialGrid(world.neighborRadius, (float)local.screenWidth, (float)local.screenHeight, world.gridSubdivision);
+        bandGrid = SpatialGrid(world.neighborRadius, (float)local.screenWidth, (float)local.screenHeight, world.gridSubdivision);
+        grid.setAggregateRadii(world.neighborRadius, world.separationRadius);
+        bandGrid.setAggregateRadii(world.neighborRadius, world.separationRadius);
+        grid.compact = bandGrid.compact = world.compactNeighbors != 0;
+    }
+
+    // Add count boids at random places in the strip, with ids from firstId on
+    void spawnRandom(size_t count, uint32_t firstId) {
+        Pcg32 rng((uint64_t)world.seed, (uint64_t)transport.rank + 1);  // A stream per tile
+        current.reserve(current.size() + count);
+        for (size_t k = 0; k < count; k++) {
+            float x = (float)rng.range((int)x0, (int)x1 - 1) - originX();
+            current.push_back(Boid({ x, (float)rng.range(0, world.screenHeight) }, rng));
+            ids.push_back(firstId + (uint32_t)k);
+        }
+    }
+
+    // Queue a boid for a neighbor, moving its position from the local frame to the world.
+    // A migrant past the world's edge wraps like Boid::borders wraps it; a ghost sent
+    // across the edge is shifted by the world width to arrive next to the receiver.
+    void pack(int direction, size_t i, bool ghost) {
+        float x = current.px[i] + originX();
+        if (!ghost) {
+            if (x < 0) x = (float)world.screenWidth;
+            if (x > world.screenWidth) x = 0;
+        } else if (direction == TileTransport::TO_LEFT && transport.rank == 0) {
+            x += world.screenWidth;
+        } else if (direction == TileTransport::TO_RIGHT && transport.rank == transport.ranks - 1) {
+            x -= world.screenWidth;
+        }
+        batches[direction].push_back({ x, current.py[i], current.vx[i], current.vy[i], ids[i] });
+    }
+
+    // A boid from a batch, in the local frame
+    Boid unpack(const TileBoid& boid) const {
+        Vector2 velocity = { boid.vx, boid.vy };
+        return Boid({ boid.px - originX(), boid.py }, velocity, Boid::headingOf(Vector2Normalize(velocity)));
+    }
+
+    // Move the owned boids that are outside the strip into the batches, and keep them
+    // as ghosts in the band if keepAsGhosts
+    void packMigrants(bool keepAsGhosts) {
+        float stripLeft = halo, stripRight = halo + (x1 - x0);  // The strip in the local frame
+        bool lastTile = transport.rank == transport.ranks - 1;   // Also owns x = world width, where borders() puts boids
+        for (std::vector<TileBoid>& batch : batches) batch.clear();
+        for (size_t i = current.size(); i-- > 0;) {
+            float x = current.px[i];
+            if (x >= stripLeft && (lastTile ? x <= stripRight : x < stripRight)) continue;
+            pack(x < stripLeft ? TileTransport::TO_LEFT : TileTransport::TO_RIGHT, i, false);
+            if (keepAsGhosts) {
+                band.push_back(current.get(i));
+                bandOwner.push_back(-1);
+            }
+            current.swapRemove(i);
+            ids[i] = ids.back();
+            ids.pop_back();
+        }
+        for (int direction = 0; direction < 2; direction++) {
+            counts[direction][0] = (uint32_t)batches[direction].size();
+            counts[direction][1] = 0;
+            migrantsSent += counts[direction][0];
+        }
+    }
+
+    // Swap the batch sizes with the neighbors and start the transfer
+    void startExchange() {
+        transport.exchangeCounts(counts, received);
+        for (int direction = 0; direction < 2; direction++) incoming[direction].resize(received[direction][0] + received[direction][1]);
+        transport.start(batches, incoming);
+    }
+
+    // Wait for the neighbors' batches; their migrants join the owned boids and their ghosts the band
+    void finishExchange() {
+        transport.finish();
+        for (int direction = 0; direction < 2; direction++) {
+            const std::vector<TileBoid>& batch = incoming[direction];
+            for (uint32_t k = 0; k < batch.size(); k++) {
+                Boid boid = unpack(batch[k]);
+                if (k < received[direction][0]) {  // Migrants come first in a batch
+                    current.push_back(boid);
+                    ids.push_back(batch[k].id);
+                } else {
+                    band.push_back(boid);
+                    bandOwner.push_back(-1);
+                }
+            }
+        }
+    }
+
+    // Step the boid stored at index b of boids from the given grid, into next[owner]
+    void stepBoid(const BoidSoA& boids, size_t b, const SpatialGrid& from, size_t owner) {
+        Boid boid = boids.get(b);
+        if (local.fastMath) {
+            boid.applyForce(boid.flock<FastMath>(from, kernel, local));
+            boid.update<FastMath>(local);
+        } else {
+            boid.applyForce(boid.flock(from, kernel, local));
+            boid.update(local);
+        }
+        boid.borders(local);  // Only wraps y: a boid moves less than a halo width per step
+        next.set(owner, boid);
+    }
+
+    void step() {
+        if (world.balanceInterval > 0 && ++stepsSinceBalance >= world.balanceInterval) rebalance();
+        float stripLeft = halo, stripRight = halo + (x1 - x0);  // The strip in the local frame
+
+        // 1. Migrants and ghosts out. Migrants leave the owned boids and become ghosts here.
+        band.resize(0);
+        bandOwner.clear();
+        packMigrants(true);
+        for (size_t i = 0; i < current.size(); i++) {
+            float x = current.px[i];
+            if (x < stripLeft + halo) pack(TileTransport::TO_LEFT, i, true);
+            if (x >= stripRight - halo) pack(TileTransport::TO_RIGHT, i, true);
+        }
+        for (int direction = 0; direction < 2; direction++) {
+            counts[direction][1] = (uint32_t)batches[direction].size() - counts[direction][0];
+            ghostsSent += counts[direction][1];
+        }
+        startExchange();
+
+        // 2. The interior, overlapped with the exchange
+        auto computeStart = std::chrono::steady_clock::now();
+        interior.clear();
+        for (size_t i = 0; i < current.size(); i++) {
+            if (current.px[i] >= stripLeft + margin && current.px[i] < stripRight - margin) interior.push_back(i);
+        }
+        next.resize(current.size());
+        {
+            PROFILE_SCOPE(PHASE_GRID);
+            grid.build(current);
+        }
+        pool->parallelFor(0, interior.size(), world.chunkSize, [this](size_t begin, size_t end) {
+            PROFILE_SCOPE(PHASE_FORCES);
+            for (size_t k = begin; k < end; k++) stepBoid(current, interior[k], grid, interior[k]);
+        });
+        computeSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - computeStart).count();
+
+        // 3. Migrants in, then the edges from the owned boids near them and the ghosts
+        finishExchange();
+        computeStart = std::chrono::steady_clock::now();
+        next.resize(current.size());
+        edge.clear();
+        for (size_t i = 0; i < current.size(); i++) {
+            float x = current.px[i];
+            if (x >= stripLeft + margin + halo && x < stripRight - margin - halo) continue;  // Not even a neighbor of an edge boid
+            if (x < stripLeft + margin || x >= stripRight - margin) edge.push_back(band.size());
+            band.push_back(current.get(i));
+            bandOwner.push_back((int)i);
+        }
+        {
+            PROFILE_SCOPE(PHASE_GRID);
+            bandGrid.build(band);
+        }
+        pool->parallelFor(0, edge.size(), world.chunkSize, [this](size_t begin, size_t end) {
+            PROFILE_SCOPE(PHASE_FORCES);
+            for (size_t k = begin; k < end; k++) stepBoid(band, edge[k], bandGrid, (size_t)bandOwner[edge[k]]);
+        });
+        computeSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - computeStart).count();
+
+        std::swap(current, next);
+    }
+
+    // Move the strip boundaries so that every tile gets a share of the work in proportion
+    // to its speed. The work of a column is estimated like Simulation::balance does, from
+    // the grid of the last step, and summed over the tiles; a tile's speed is the work it
+    // got through per second of stepping since the last check, which also catches slow
+    // nodes. The boundaries move only when the current split is off by more than
+    // balance_tolerance, and never past the next boundary's old place, so every boid
+    // still ends up at most one tile away.
+    void rebalance() {
+        size_t ranks = (size_t)transport.ranks;
+        columnCosts.assign(columns, 0.0);
+        grid.blockCounts(blockCounts);
+        double ownCost = 0.0;
+        for (int c = 0; c + 1 < (int)grid.cellStart.size(); c++) {  // No cells before the first build
+            int count = grid.cellStart[c + 1] - grid.cellStart[c];
+            if (count == 0) continue;
+            float x = originX() + ((c % grid.cols) + 0.5f) * grid.cellWidth;
+            int column = std::min(std::max((int)(x / halo), 0), columns - 1);
+            double cost = count * (blockCounts[c] + 8.0);
+            columnCosts[column] += cost;
+            ownCost += cost;
+        }
+        speeds.assign(ranks, 0.0);
+        if (computeSeconds > 0) speeds[transport.rank] = ownCost * stepsSinceBalance / computeSeconds;
+        transport.sum(columnCosts);
+        transport.sum(speeds);
+        computeSeconds = 0;
+        stepsSinceBalance = 0;
+
+        // A tile that had no work has no measured speed, give it the average
+        double known = 0, speedTotal = 0;
+        for (double speed : speeds) if (speed > 0) known++, speedTotal += speed;
+        for (double& speed : speeds) if (speed <= 0) speed = known > 0 ? speedTotal / known : 1.0;
+        speedTotal = 0;
+        for (double speed : speeds) speedTotal += speed;
+        for (double& speed : speeds) speed /= speedTotal;  // Now the shares
+
+        costPrefix.assign(columns + 1, 0.0);
+        for (int c = 0; c < columns; c++) costPrefix[c + 1] = costPrefix[c] + columnCosts[c];
+        imbalance = splitImbalance(costPrefix, speeds, splits);
+        if (imbalance <= 1.0 + world.balanceTolerance) return;
+
+        balancedSplits(costPrefix, speeds, newSplits);
+        for (size_t k = 1; k < ranks; k++) {
+            size_t low = std::max(newSplits[k - 1], splits[k - 1]) + MIN_COLUMNS;
+            size_t high = splits[k + 1] - MIN_COLUMNS;
+            newSplits[k] = std::min(std::max(newSplits[k], low), high);
+        }
+        if (newSplits == splits) return;
+
+        splits = newSplits;
+        rebalances++;
+        setStrip(columnX(splits[transport.rank]), columnX(splits[transport.rank + 1]));
+        packMigrants(false);  // Hand over the boids outside the new strip before stepping
+        startExchange();
+        finishExchange();
+    }
+
+    // Checksum of all tiles together (in world coordinates it would round differently)
+    uint64_t checksum() const { return transport.sum(flockChecksum(current, ids.data())); }
+};
+
+// Seconds on a monotonic clock, shared by the simulation and render threads
+inline double monotonicSeconds() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Lock-free single-producer, single-consumer triple buffer. The writer fills back()
+// and publishes it; the reader always gets the most recently published slot and
+// keeps it until it asks again, so neither side ever waits for the other.
+template <typename T>
+struct TripleBuffer {
+    static constexpr int FRESH = 4;  // Set on `middle` when it holds a slot the reader has not seen
+
+    T slots[3];
+    int backIndex = 0;             // Slot owned by the writer
+    int frontIndex = 1;            // Slot owned by the reader
+    std::atomic<int> middle{ 2 };  // Slot in between, plus the FRESH bit
+
+    // Slot to write the next value into (writer only)
+    T& back() { return slots[backIndex]; }
+
+    // Hand the back slot to the reader and take the middle one to write next (writer only)
+    void publish() {
+        backIndex = middle.exchange(backIndex | FRESH, std::memory_order_acq_rel) & 3;
+    }
+
+    // The most recently published value (reader only)
+    const T& read() {
+        if (middle.load(std::memory_order_relaxed) & FRESH) {
+            frontIndex = middle.exchange(frontIndex, std::memory_order_acq_rel) & 3;
+        }
+        return slots[frontIndex];
+    }
+};
+
+// Two consecutive frames of the flock, as handed from the simulation thread to the renderer
+struct FlockSnapshot {
+    BoidSoA previous;  // Frame N-1
+    BoidSoA current;   // Frame N
+    SimConfig config;  // Parameters frame N was computed with
+    double time = 0;   // monotonicSeconds() at which frame N is due
+};
+
+// Runs a Simulation at its fixed rate on a thread of its own, so stepping frame N+1
+// overlaps drawing frame N. Config edits are handed over and applied between steps.
+struct SimulationThread {
+    static constexpr size_t MAX_PENDING_EDITS = 64;  // Edits beyond this between two steps are dropped
+
+    Simulation& simulation;
+    TripleBuffer<FlockSnapshot> snapshots;  // Finished frames for the renderer
+    std::thread thread;
+    std::atomic<bool> running{ false };
+    std::mutex configMutex;     // Guards pendingConfig, configPending and pendingLodView
+    SimConfig pendingConfig;    // Latest edit not yet applied by the simulation thread
+    bool configPending = false;
+    Rectangle pendingLodView;   // Latest camera view, applied as the simulation's lodView at the next step
+    std::vector<FlockEdit> pendingEdits;  // Spawns and removals not yet applied (also guarded by configMutex)
+
+    SimulationThread(Simulation& simulation) : simulation(simulation), pendingLodView(simulation.lodView) {
+        pendingEdits.reserve(MAX_PENDING_EDITS);
+    }
+    ~SimulationThread() { stop(); }
+
+    // Publish the starting frame and start stepping
+    void start() {
+        publish(monotonicSeconds());
+        snapshots.read();  // Take the starting frame so the reader never sees an empty slot
+        running = true;
+        thread = std::thread([this] { run(); });
+    }
+
+    void stop() {
+        running = false;
+        if (thread.joinable()) thread.join();
+    }
+
+    // Queue new parameters for the next step boundary (render thread)
+    void setConfig(const SimConfig& config) {
+        std::lock_guard<std::mutex> lock(configMutex);
+        pendingConfig = config;
+        configPending = true;
+    }
+
+    // Queue a spawn or removal for the next step boundary (render thread)
+    void edit(const FlockEdit& flockEdit) {
+        std::lock_guard<std::mutex> lock(configMutex);
+        if (pendingEdits.size() < MAX_PENDING_EDITS) pendingEdits.push_back(flockEdit);
+    }
+
+    // Queue the part of the world in view for the next step boundary (render thread)
+    void setLodView(const Rectangle& lodView) {
+        std::lock_guard<std::mutex> lock(configMutex);
+        pendingLodView = lodView;
+    }
+
+    // The latest finished frames (render thread)
+    const FlockSnapshot& latest() { return snapshots.read(); }
+
+    // Copy the simulation's last two frames into the back slot and publish it
+    void publish(double time) {
+        FlockSnapshot& snapshot = snapshots.back();
+        snapshot.previous = simulation.next;  // After a step, `next` holds the previous frame
+        snapshot.current = simulation.current;
+        snapshot.config = simulation.config;
+        snapshot.time = time;
+        snapshots.publish();
+    }
+
+    void run() {
+        double simTime = monotonicSeconds();  // Time at which the current frame is due
+        while (running) {
+            {
+                std::lock_guard<std::mutex> lock(configMutex);
+                if (configPending) {
+                    simulation.setConfig(pendingConfig);
+                    configPending = false;
+                }
+                for (const FlockEdit& flockEdit : pendingEdits) simulation.applyEdit(flockEdit);
+                pendingEdits.clear();
+                simulation.lodView = pendingLodView;
+            }
+
+            // Wait until the next frame is due, waking regularly to notice edits and stop()
+            double dt = 1.0 / simulation.config.simRate;
+            double now = monotonicSeconds();
+            if (now < simTime + dt) {
+                std::this_thread::sleep_for(std::chrono::duration<double>(std::min(simTime + dt - now, 0.005)));
+                continue;
+            }
+            if (now - simTime > dt * simulation.config.maxStepsPerFrame) simTime = now - dt;  // Too far behind: drop the backlog
+
+            simulation.step();
+            simTime += dt;
+            publish(simTime);
+        }
+    }
+};
+
+// Run the simulation without a window for a number of steps at each flock size and
+// report its throughput and step latency
+int runHeadless(const SimConfig& baseConfig, const std::vector<int>& boidCounts, int steps, int warmupSteps, FrameRecorder* recorder) {
+    printf("%10s %10s %12s %14s %10s %10s %10s %10s %18s\n",
+        "boids", "steps", "steps/s", "ns/boid/step", "p50 ms", "p90 ms", "p99 ms", "max ms", "checksum");
+
+    for (int boidCount : boidCounts) {
+        SimConfig config = baseConfig;
+        config.numBoids = boidCount;
+        Simulation simulation(config);
+        simulation.recorder = recorder;
+        if (recorder) recorder->blocking = true;  // Nothing is real-time here: record every frame
+        for (int i = 0; i < warmupSteps; i++) {
+            simulation.step();  // Let the flock form clusters before measuring
+        }
+
+        std::vector<double> stepTimes(steps);  // Duration of every step in seconds
+        auto runStart = std::chrono::steady_clock::now();
+        for (int i = 0; i < steps; i++) {
+            auto stepStart = std::chrono::steady_clock::now();
+            simulation.step();
+            stepTimes[i] = std::chrono::duration<double>(std::chrono::steady_clock::now() - stepStart).count();
+        }
+        double total = std::chrono::duration<double>(std::chrono::steady_clock::now() - runStart).count();
+
+        // Percentiles of the step latency
+        std::sort(stepTimes.begin(), stepTimes.end());
+        auto percentile = [&](double p) { return stepTimes[std::min((size_t)(p * steps), stepTimes.size() - 1)] * 1000.0; };
+
+        printf("%10d %10d %12.1f %14.2f %10.3f %10.3f %10.3f %10.3f %18llx\n",
+            boidCount, steps, steps / total, total * 1e9 / ((double)steps * boidCount),
+            percentile(0.50), percentile(0.90), percentile(0.99), stepTimes.back() * 1000.0,
+            (unsigned long long)simulation.checksum());
+        if (config.lodInterval > 1) {
+            printf("%10s %.1f%% of the flocking updates coasted (lod_interval %d, lod_error %g)\n", "",
+                100.0 * simulation.lodSkipped / ((double)(steps + warmupSteps) * boidCount), config.lodInterval, config.lodError);
+        }
+        fflush(stdout);
+    }
+    return 0;
+}
+
+// Run the simulation without a window and check every step of it against the scalar
+// reference (see StepValidator), returns 1 if any step was off by more than the tolerance
+int runValidation(const SimConfig& baseConfig, const std::vector<int>& boidCounts, int steps) {
+    printf("%10s %10s %8s %12s %12s %14s %14s %18s %6s\n",
+        "boids", "steps", "kernel", "exact steps", "mismatched", "max pos err", "max vel err", "checksum", "");
+
+    int result = 0;
+    for (int boidCount : boidCounts) {
+        SimConfig config = baseConfig;
+        config.numBoids = boidCount;
+        Simulation simulation(config);
+        StepValidator validator(simulation.config);
+        for (int i = 0; i < steps; i++) {
+            validator.expect(simulation.current, simulation.arena, simulation.stepsSinceReorder, simulation.stepCount, simulation.config);
+            simulation.step();
+            validator.check(simulation.current);
+        }
+
+        printf("%10d %10d %8s %12llu %12llu %14.3g %14.3g %18llx %6s\n",
+            boidCount, steps, simulation.kernel.name, (unsigned long long)validator.exactSteps, (unsigned long long)validator.mismatchedBoids,
+            validator.maxPositionError, validator.maxVelocityError, (unsigned long long)simulation.checksum(),
+            validator.passed() ? "ok" : "FAILED");
+        fflush(stdout);
+        if (!validator.passed()) result = 1;
+    }
+    return result;
+}
+
+// Run a flock of boidCount boids split into tiles, one per MPI rank (see TileDomain),
+// and report the throughput and step latency from rank 0. Each tile is a vertical
+// strip of the world, which is screen_width x screen_height.
+int runDistributed(const SimConfig& config, int boidCount, int steps, int warmupSteps) {
+#if defined(FLOCK_MPI)
+    MPI_Init(nullptr, nullptr);
+#endif
+    TileTransport transport;
+    transport.init();
+
+    if (!TileDomain::fits(config, transport.ranks)) {
+        if (transport.rank == 0) fprintf(stderr, "A world %d wide can't be split into %d strips of %d neighbor radii, or max_speed outruns the neighbor radius\n", config.screenWidth, transport.ranks, TileDomain::MIN_COLUMNS);
+#if defined(FLOCK_MPI)
+        MPI_Finalize();
+#endif
+        return 1;
+    }
+
+    int rank = transport.rank, ranks = transport.ranks;
+    TileDomain tile(config, transport);
+    size_t share = (size_t)boidCount / ranks, extra = (size_t)boidCount % ranks;
+    tile.spawnRandom(share + (rank < (int)extra ? 1 : 0), (uint32_t)(rank * share + std::min<size_t>(rank, extra)));
+
+    for (int i = 0; i < warmupSteps; i++) tile.step();
+
+    std::vector<double> stepTimes(steps);
+    uint64_t ghostsBefore = tile.ghostsSent, migrantsBefore = tile.migrantsSent;
+    int rebalancesBefore = tile.rebalances;
+    auto runStart = std::chrono::steady_clock::now();
+    for (int i = 0; i < steps; i++) {
+        auto stepStart = std::chrono::steady_clock::now();
+        tile.step();
+        stepTimes[i] = std::chrono::duration<double>(std::chrono::steady_clock::now() - stepStart).count();
+    }
+    double total = std::chrono::duration<double>(std::chrono::steady_clock::now() - runStart).count();
+
+    // A step of the run takes as long as its slowest tile
+    transport.max(stepTimes);
+    uint64_t ghosts = transport.sum(tile.ghostsSent - ghostsBefore);
+    uint64_t migrants = transport.sum(tile.migrantsSent - migrantsBefore);
+    uint64_t boids = transport.sum(tile.current.size());
+    uint64_t checksum = tile.checksum();
+    if (rank == 0) {
+        std::sort(stepTimes.begin(), stepTimes.end());
+        auto percentile = [&](double p) { return stepTimes[std::min((size_t)(p * steps), stepTimes.size() - 1)] * 1000.0; };
+        printf("%6s %10s %10s %12s %14s %10s %10s %12s %12s %10s %10s %18s\n",
+            "ranks", "boids", "steps", "steps/s", "ns/boid/step", "p50 ms", "p99 ms", "ghosts/step", "moved/step", "imbalance", "rebalances", "checksum");
+        printf("%6d %10llu %10d %12.1f %14.2f %10.3f %10.3f %12.1f %12.1f %10.3f %10d %18llx\n",
+            ranks, (unsigned long long)boids, steps, steps / total, total * 1e9 / ((double)steps * std::max<uint64_t>(boids, 1)),
+            percentile(0.50), percentile(0.99), (double)ghosts / steps, (double)migrants / steps, tile.imbalance,
+            tile.rebalances - rebalancesBefore, (unsigned long long)checksum);
+        fflush(stdout);
+    }
+#if defined(FLOCK_MPI)
+    MPI_Finalize();
+#endif
+    return 0;
+}
 
-    // Constructor to initialize a boid with a given position
-    Boid(Vector2 position) {
-        this->position = position;
-        velocity = { (float)GetRandomValue(-2, 2), (float)GetRandomValue(-2, 2) };  // Random initial velocity
-        acceleration = { 0.0f, 0.0f };  // No initial acceleration
-        rotation = atan2(velocity.y, velocity.x);  // Calculate the rotation based on the initial velocity
+// Parse a comma separated list of positive integers, e.g. "1000,5000,20000"
+std::vector<int> parseIntList(const char* text) {
+    std::vector<int> values;
+    for (const char* p = text; *p; ) {
+        char* end;
+        long value = strtol(p, &end, 10);
+        if (end == p) break;  // Not a number
+        if (value > 0) values.push_back((int)value);
+        p = (*end == ',') ? end + 1 : end;
     }
+    return values;
+}
 
-    // Update the boid's position based on its velocity and acceleration
-    void update() {
-        velocity = Vector2Add(velocity, acceleration);  // Add acceleration to velocity
-        velocity = Vector2Scale(Vector2Normalize(velocity), MAX_SPEED);  // Limit velocity to max speed
-        position = Vector2Add(position, velocity);  // Update position based on velocity
+// Draws the whole flock with a single instanced draw call. The boid shape is a
+// shared 6-vertex template; the vertex shader places and rotates it from a
+// per-boid position and heading, uploaded straight from the BoidSoA arrays once
+// per frame. Falls back to drawing every boid with DrawTriangle when the GL
+// backend has no instancing.
+struct BoidRenderer {
+    unsigned int shaderId = 0;          // Shader program building the boid triangles
+    unsigned int vao = 0;               // Vertex array with the template and the instance buffers
+    unsigned int templateVbo = 0;       // The boid shape, pointing along +x
+    unsigned int instanceVbos[4] = {};  // Per-boid x, y and heading x, y
+    int positionAttrib = -1;            // Attribute of the template vertices
+    int instanceAttribs[4] = { -1, -1, -1, -1 };  // Attributes of the per-boid values
+    int mvpLoc = -1, colorLoc = -1;
+    size_t capacity = 0;                // Number of boids the instance buffers can hold
+    unsigned int storageShaderId = 0;   // Shader reading the boids from a GPU storage buffer (OpenGL 4.3)
+    int storageMvpLoc = -1, storageColorLoc = -1;
 
-        acceleration = { 0.0f, 0.0f };  // Reset acceleration after each update
-        rotation = atan2(velocity.y, velocity.x);  // Update rotation based on the new velocity
+    bool ready() const { return shaderId != 0; }
+
+    // Compile the shader and create the vertex buffers, returns false if instancing is unavailable
+    bool init() {
+        int version = rlGetVersion();
+        if (version != RL_OPENGL_33 && version != RL_OPENGL_43) {
+            TraceLog(LOG_INFO, "FLOCK: Instanced rendering needs OpenGL 3.3, drawing boids one by one");
+            return false;
+        }
+
+        const char* vertexShader =
+            "#version 330\n"
+            "in vec2 vertexPosition;\n"
+            "in float instanceX;\n"
+            "in float instanceY;\n"
+            "in float instanceHeadingX;\n"
+            "in float instanceHeadingY;\n"
+            "uniform mat4 mvp;\n"
+            "void main() {\n"
+            "    vec2 h = vec2(instanceHeadingX, instanceHeadingY);\n"
+            "    vec2 p = vec2(instanceX, instanceY) + vec2(h.x * vertexPosition.x - h.y * vertexPosition.y, h.y * vertexPosition.x + h.x * vertexPosition.y);\n"
+            "    gl_Position = mvp * vec4(p, 0.0, 1.0);\n"
+            "}\n";
+        const char* fragmentShader =
+            "#version 330\n"
+            "uniform vec4 color;\n"
+            "out vec4 finalColor;\n"
+            "void main() {\n"
+            "    finalColor = color;\n"
+            "}\n";
+
+        shaderId = rlLoadShaderCode(vertexShader, fragmentShader);
+        if (shaderId == 0) {
+            TraceLog(LOG_WARNING, "FLOCK: Failed to build the boid shader, drawing boids one by one");
+            return false;
+        }
+        positionAttrib = rlGetLocationAttrib(shaderId, "vertexPosition");
+        instanceAttribs[0] = rlGetLocationAttrib(shaderId, "instanceX");
+        instanceAttribs[1] = rlGetLocationAttrib(shaderId, "instanceY");
+        instanceAttribs[2] = rlGetLocationAttrib(shaderId, "instanceHeadingX");
+        instanceAttribs[3] = rlGetLocationAttrib(shaderId, "instanceHeadingY");
+        mvpLoc = rlGetLocationUniform(shaderId, "mvp");
+        colorLoc = rlGetLocationUniform(shaderId, "color");
+
+        // Same two triangles as Boid::drawAt, in the same vertex order, for a boid at the origin
+        const float wingX = 0.5f * 6, wingY = 0.86602540378f * 6;
+        const float shape[12] = {
+            0.0f, 0.0f,   10.0f, 0.0f,   wingX, wingY,     // Body + left wing
+            0.0f, 0.0f,   10.0f, 0.0f,   wingX, -wingY,    // Body + right wing
+        };
+
+        vao = rlLoadVertexArray();
+        rlEnableVertexArray(vao);
+        templateVbo = rlLoadVertexBuffer(shape, sizeof(shape), false);
+        rlSetVertexAttribute(positionAttrib, 2, RL_FLOAT, false, 0, 0);
+        rlEnableVertexAttribute(positionAttrib);
+        rlDisableVertexArray();
+
+        reserve(1024);
+        return true;
     }
 
-    // Apply a force to the boid by adding it to its acceleration
-    void applyForce(Vector2 force) {
-        acceleration = Vector2Add(acceleration, force);  // Add the force to the acceleration
+    // Make room for at least count boids in the instance buffers
+    void reserve(size_t count) {
+        if (count <= capacity) return;
+        capacity = std::max(count, capacity * 2);
+
+        rlEnableVertexArray(vao);
+        for (int a = 0; a < 4; a++) {
+            if (instanceVbos[a]) rlUnloadVertexBuffer(instanceVbos[a]);
+            instanceVbos[a] = rlLoadVertexBuffer(nullptr, (int)(capacity * sizeof(float)), true);
+            rlSetVertexAttribute(instanceAttribs[a], 1, RL_FLOAT, false, 0, 0);
+            rlSetVertexAttributeDivisor(instanceAttribs[a], 1);  // One value per boid, not per vertex
+            rlEnableVertexAttribute(instanceAttribs[a]);
+        }
+        rlDisableVertexArray();
     }
 
-    // Ensure the boid wraps around the screen edges
-    void borders() {
-        if (position.x < 0) position.x = screenWidth;   // Wrap around horizontally
-        if (position.x > screenWidth) position.x = 0;   // Wrap around horizontally
-        if (position.y < 0) position.y = screenHeight;  // Wrap around vertically
-        if (position.y > screenHeight) position.y = 0;  // Wrap around vertically
+    // Draw every boid of the flock
+    void draw(const BoidSoA& boids, Color color) {
+        draw(boids.px.data(), boids.py.data(), boids.hx.data(), boids.hy.data(), boids.size(), color);
     }
 
-    // Separation behavior: steer away from nearby boids to avoid crowding
-    Vector2 separate(std::vector<Boid>& boids) {
-        Vector2 steer = { 0.0f, 0.0f };  // Vector to store the steering force
-        int count = 0;
+    // Draw count boids from separate position and heading arrays
+    void draw(const float* px, const float* py, const float* hx, const float* hy, size_t count, Color color) {
+        if (!ready()) {
+            for (size_t i = 0; i < count; i++) {
+                Boid::drawAt({ px[i], py[i] }, { hx[i], hy[i] });
+            }
+            return;
+        }
+        if (count == 0) return;
 
-        // Loop through all boids and check their distance to the current boid
-        for (auto& other : boids) {
-            float d = Vector2Distance(position, other.position);
-            if (d > 0 && d < SEPARATION_RADIUS) {  // If the boid is within the separation radius
-                Vector2 diff = Vector2Subtract(position, other.position);  // Vector pointing away from the other boid
-                diff = Vector2Normalize(diff);  // Normalize the vector
-                diff = Vector2Scale(diff, 1.0f / d);  // Scale by the inverse of the distance to add more force for closer boids
-                steer = Vector2Add(steer, diff);  // Add this force to the steering vector
-                count++;
+        // Upload this frame's instance data
+        reserve(count);
+        int bytes = (int)(count * sizeof(float));
+        rlUpdateVertexBuffer(instanceVbos[0], px, bytes, 0);
+        rlUpdateVertexBuffer(instanceVbos[1], py, bytes, 0);
+        rlUpdateVertexBuffer(instanceVbos[2], hx, bytes, 0);
+        rlUpdateVertexBuffer(instanceVbos[3], hy, bytes, 0);
+
+        rlDrawRenderBatchActive();  // Flush whatever raylib batched so far, so the draw order is kept
+
+        Matrix mvp = MatrixMultiply(rlGetMatrixModelview(), rlGetMatrixProjection());
+        float colorValue[4] = { color.r / 255.0f, color.g / 255.0f, color.b / 255.0f, color.a / 255.0f };
+        rlEnableShader(shaderId);
+        rlSetUniformMatrix(mvpLoc, mvp);
+        rlSetUniform(colorLoc, colorValue, RL_SHADER_UNIFORM_VEC4, 1);
+        rlEnableVertexArray(vao);
+        rlDrawVertexArrayInstanced(0, 6, (int)count);
+        rlDisableVertexArray();
+        rlDisableShader();
+    }
+
+    // Compile the shader that draws boids straight from GpuSimulation's state buffer
+    bool initStorageShader() {
+        if (!ready() || rlGetVersion() != RL_OPENGL_43) return false;
+
+        const char* vertexShader =
+            "#version 430\n"
+            "in vec2 vertexPosition;\n"
+            "layout(std430, binding = 0) readonly buffer Boids { vec4 boids[]; };\n"  // xy = position, zw = velocity
+            "uniform mat4 mvp;\n"
+            "void main() {\n"
+            "    vec4 boid = boids[gl_InstanceID];\n"
+            "    vec2 h = dot(boid.zw, boid.zw) > 0.0 ? normalize(boid.zw) : vec2(1.0, 0.0);\n"
+            "    vec2 p = boid.xy + vec2(h.x * vertexPosition.x - h.y * vertexPosition.y, h.y * vertexPosition.x + h.x * vertexPosition.y);\n"
+            "    gl_Position = mvp * vec4(p, 0.0, 1.0);\n"
+            "}\n";
+        const char* fragmentShader =
+            "#version 430\n"
+            "uniform vec4 color;\n"
+            "out vec4 finalColor;\n"
+            "void main() {\n"
+            "    finalColor = color;\n"
+            "}\n";
+
+        storageShaderId = rlLoadShaderCode(vertexShader, fragmentShader);
+        storageMvpLoc = rlGetLocationUniform(storageShaderId, "mvp");
+        storageColorLoc = rlGetLocationUniform(storageShaderId, "color");
+        return storageShaderId != 0;
+    }
+
+    // Draw count boids stored in a GPU storage buffer, without copying them back to the host
+    void drawStorage(unsigned int stateBuffer, int count, Color color) {
+        if (storageShaderId == 0 || count == 0) return;
+
+        rlDrawRenderBatchActive();  // Flush whatever raylib batched so far, so the draw order is kept
+
+        Matrix mvp = MatrixMultiply(rlGetMatrixModelview(), rlGetMatrixProjection());
+        float colorValue[4] = { color.r / 255.0f, color.g / 255.0f, color.b / 255.0f, color.a / 255.0f };
+        rlEnableShader(storageShaderId);
+        rlSetUniformMatrix(storageMvpLoc, mvp);
+        rlSetUniform(storageColorLoc, colorValue, RL_SHADER_UNIFORM_VEC4, 1);
+        rlBindShaderBuffer(stateBuffer, 0);
+        rlEnableVertexArray(vao);
+        rlDrawVertexArrayInstanced(0, 6, count);
+        rlDisableVertexArray();
+        rlDisableShader();
+    }
+
+    void unload() {
+        if (!ready()) return;
+        if (storageShaderId) rlUnloadShaderProgram(storageShaderId);
+        rlUnloadVertexBuffer(templateVbo);
+        for (unsigned int vbo : instanceVbos) rlUnloadVertexBuffer(vbo);
+        rlUnloadVertexArray(vao);
+        rlUnloadShaderProgram(shaderId);
+        shaderId = 0;
+    }
+};
+
+// Layout of the Params storage buffer shared by the compute shaders (std430, all 4-byte members)
+struct GpuParams {
+    unsigned int boidCount;
+    int cols, rows;
+    float cellWidth, cellHeight;
+    float width, height;
+    float maxSpeed, maxForce;
+    float neighborRadius, separationRadius;
+    float cohesionWeight, alignmentWeight, separationWeight;
+    float stepScale;
+};
+
+// Declarations shared by every compute shader
+const char* GPU_SHADER_HEADER = R"(#version 430
+layout(std430, binding = 0) buffer StateIn { vec4 stateIn[]; };       // xy = position, zw = velocity
+layout(std430, binding = 1) buffer StateOut { vec4 stateOut[]; };
+layout(std430, binding = 2) buffer Sorted { vec4 sorted[]; };         // stateIn in cell order
+layout(std430, binding = 3) buffer CellCount { uint cellCount[]; };
+layout(std430, binding = 4) buffer CellStart { uint cellStart[]; };   // cols*rows + 1 entries
+layout(std430, binding = 5) buffer BoidSlot { uvec2 boidSlot[]; };    // Cell of each boid and its rank inside it
+layout(std430, binding = 6) readonly buffer Params {
+    uint boidCount;
+    int cols, rows;
+    float cellWidth, cellHeight;
+    float width, height;
+    float maxSpeed, maxForce;
+    float neighborRadius, separationRadius;
+    float cohesionWeight, alignmentWeight, separationWeight;
+    float stepScale;
+};
+
+ivec2 cellOf(vec2 p) {
+    return ivec2(clamp(int(p.x / cellWidth), 0, cols - 1), clamp(int(p.y / cellHeight), 0, rows - 1));
+}
+)";
+
+// Reset the per-cell counters
+const char* GPU_CLEAR_SHADER = R"(
+layout(local_size_x = 256) in;
+void main() {
+    uint c = gl_GlobalInvocationID.x;
+    if (c < uint(cols * rows)) cellCount[c] = 0u;
+}
+)";
+
+// Count the boids of each cell; the atomic returns each boid's rank inside its cell
+const char* GPU_COUNT_SHADER = R"(
+layout(local_size_x = 256) in;
+void main() {
+    uint i = gl_GlobalInvocationID.x;
+    if (i >= boidCount) return;
+    ivec2 cell = cellOf(stateIn[i].xy);
+    uint index = uint(cell.y * cols + cell.x);
+    boidSlot[i] = uvec2(index, atomicAdd(cellCount[index], 1u));
+}
+)";
+
+// Exclusive prefix sum of the counts into cellStart, in a single work group: every
+// thread sums a run of cells, the run totals are scanned in shared memory, then
+// every thread writes the offsets of its run
+const char* GPU_SCAN_SHADER = R"(
+layout(local_size_x = 1024) in;
+shared uint runTotals[1024];
+void main() {
+    uint t = gl_LocalInvocationID.x;
+    uint cells = uint(cols * rows);
+    uint perThread = (cells + 1023u) / 1024u;
+    uint begin = min(t * perThread, cells);
+    uint end = min(begin + perThread, cells);
+
+    uint total = 0u;
+    for (uint c = begin; c < end; c++) total += cellCount[c];
+    runTotals[t] = total;
+    barrier();
+
+    for (uint offset = 1u; offset < 1024u; offset <<= 1) {
+        uint value = t >= offset ? runTotals[t - offset] : 0u;
+        barrier();
+        runTotals[t] += value;
+        barrier();
+    }
+
+    uint running = runTotals[t] - total;
+    for (uint c = begin; c < end; c++) {
+        cellStart[c] = running;
+        running += cellCount[c];
+    }
+    if (t == 1023u) cellStart[cells] = runTotals[1023];
+}
+)";
+
+// Copy every boid to its slot in cell order
+const char* GPU_SCATTER_SHADER = R"(
+layout(local_size_x = 256) in;
+void main() {
+    uint i = gl_GlobalInvocationID.x;
+    if (i >= boidCount) return;
+    uvec2 slot = boidSlot[i];
+    sorted[cellStart[slot.x] + slot.y] = stateIn[i];
+}
+)";
+
+// Fused force pass plus update and borders: the same rules as Boid::flock,
+// Boid::update and Boid::borders
+const char* GPU_STEP_SHADER = R"(
+layout(local_size_x = 256) in;
+
+vec2 safeNormalize(vec2 v) {
+    float length2 = dot(v, v);
+    return length2 > 0.0 ? v * (1.0 / sqrt(length2)) : vec2(0.0);
+}
+
+vec2 steerTowards(vec2 direction, vec2 velocity) {
+    vec2 steer = safeNormalize(direction) * maxSpeed - velocity;
+    if (length(steer) > maxForce) steer = safeNormalize(steer) * maxForce;
+    return steer;
+}
+
+vec2 position;
+float separationRadiusSq, neighborRadiusSq;
+vec2 separation, velocitySum, positionSum;
+int separationCount, neighborCount;
+
+// Accumulate the cells first..last of a row, with their positions moved by shift
+void accumulateRun(int row, int first, int last, vec2 shift) {
+    for (uint e = cellStart[row * cols + first]; e < cellStart[row * cols + last + 1]; e++) {
+        vec4 other = sorted[e];
+        vec2 otherPosition = other.xy + shift;  // Nearest periodic image
+        vec2 diff = position - otherPosition;
+        float d2 = dot(diff, diff);
+        if (d2 > 0.0 && d2 < neighborRadiusSq) {
+            velocitySum += other.zw;
+            positionSum += otherPosition;
+            neighborCount++;
+            if (d2 < separationRadiusSq) {
+                separation += diff * (1.0 / d2);
+                separationCount++;
             }
         }
+    }
+}
 
-        // If there are nearby boids, average the steering forces
-        if (count > 0) {
-            steer = Vector2Scale(steer, 1.0f / (float)count);  // Normalize the force by the number of boids
+void main() {
+    uint i = gl_GlobalInvocationID.x;
+    if (i >= boidCount) return;
+    position = stateIn[i].xy;
+    vec2 velocity = stateIn[i].zw;
+    separationRadiusSq = separationRadius * separationRadius;
+    neighborRadiusSq = neighborRadius * neighborRadius;
+
+    separation = vec2(0.0);
+    velocitySum = vec2(0.0);
+    positionSum = vec2(0.0);
+    separationCount = 0;
+    neighborCount = 0;
+
+    // Same wrapped runs as SpatialGrid::neighborRuns
+    ivec2 cell = cellOf(position);
+    for (int dy = -1; dy <= 1; dy++) {
+        int row = cell.y + dy;
+        float shiftY = 0.0;
+        if (rows == 1) {
+            if (dy != 0) continue;
+        } else if (row < 0) {
+            row = rows - 1;
+            shiftY = -height;
+        } else if (row >= rows) {
+            row = 0;
+            shiftY = height;
         }
+        accumulateRun(row, max(cell.x - 1, 0), min(cell.x + 1, cols - 1), vec2(0.0, shiftY));
+        if (cols > 1 && cell.x == 0) accumulateRun(row, cols - 1, cols - 1, vec2(-width, shiftY));
+        if (cols > 1 && cell.x == cols - 1) accumulateRun(row, 0, 0, vec2(width, shiftY));
+    }
 
-        // If there is any steering force, limit it to the maximum force
-        if (Vector2Length(steer) > 0) {
-            steer = Vector2Normalize(steer);  // Normalize the steering force
-            steer = Vector2Scale(steer, MAX_SPEED);  // Scale to maximum speed
-            steer = Vector2Subtract(steer, velocity);  // Subtract the current velocity to get the required force
-            if (Vector2Length(steer) > MAX_FORCE) {
-                steer = Vector2Scale(Vector2Normalize(steer), MAX_FORCE);  // Limit the force to MAX_FORCE
-            }
+    vec2 force = vec2(0.0);
+    if (separationCount > 0) separation *= 1.0 / float(separationCount);
+    if (length(separation) > 0.0) force += steerTowards(separation, velocity) * separationWeight;
+    if (neighborCount > 0) {
+        float inverseCount = 1.0 / float(neighborCount);
+        force += steerTowards(velocitySum * inverseCount, velocity) * alignmentWeight;
+        force += steerTowards(positionSum * inverseCount - position, velocity) * cohesionWeight;
+    }
+
+    velocity = safeNormalize(velocity + force * stepScale) * maxSpeed;
+    position += velocity * stepScale;
+
+    if (position.x < 0.0) position.x = width;
+    if (position.x > width) position.x = 0.0;
+    if (position.y < 0.0) position.y = height;
+    if (position.y > height) position.y = 0.0;
+
+    stateOut[i] = vec4(position, velocity);
+}
+)";
+
+#if !defined(_WIN32)
+extern "C" void* glfwGetProcAddress(const char* name) __attribute__((weak));
+#else
+extern "C" void* glfwGetProcAddress(const char* name);
+#endif
+
+// Optional simulation backend running entirely in compute shaders (needs raylib built
+// for OpenGL 4.3). The flock lives in GPU storage buffers: every step rebuilds the
+// grid with an atomic counting sort and a prefix scan, then runs the fused force pass
+// into the other state buffer. BoidRenderer::drawStorage draws from that buffer, so
+// positions never come back to the host unless download() is called.
+struct GpuSimulation {
+    unsigned int clearProgram = 0, countProgram = 0, scanProgram = 0, scatterProgram = 0, stepProgram = 0;
+    unsigned int stateBuffers[2] = {};  // Ping-pong state, stateBuffers[current] holds frame N
+    unsigned int sortedBuffer = 0, cellCountBuffer = 0, cellStartBuffer = 0, boidSlotBuffer = 0, paramsBuffer = 0;
+    int current = 0;
+    GpuParams params = {};
+    void (*memoryBarrier)(unsigned int) = nullptr;  // glMemoryBarrier, which rlgl doesn't expose
+
+    bool ready() const { return stepProgram != 0; }
+
+    // Compile the compute shaders, returns false if compute shaders are unavailable
+    bool init() {
+        if (rlGetVersion() != RL_OPENGL_43) {
+            TraceLog(LOG_WARNING, "FLOCK: GPU backend needs OpenGL 4.3, using the CPU simulation");
+            return false;
         }
 
-        return steer;  // Return the separation steering force
+        auto compile = [](const char* body) {
+            std::string code = std::string(GPU_SHADER_HEADER) + body;
+            unsigned int shader = rlCompileShader(code.c_str(), RL_COMPUTE_SHADER);
+            return shader ? rlLoadComputeShaderProgram(shader) : 0u;
+        };
+        clearProgram = compile(GPU_CLEAR_SHADER);
+        countProgram = compile(GPU_COUNT_SHADER);
+        scanProgram = compile(GPU_SCAN_SHADER);
+        scatterProgram = compile(GPU_SCATTER_SHADER);
+        stepProgram = compile(GPU_STEP_SHADER);
+        if (!clearProgram || !countProgram || !scanProgram || !scatterProgram || !stepProgram) {
+            TraceLog(LOG_WARNING, "FLOCK: Failed to build the compute shaders, using the CPU simulation");
+            unload();
+            return false;
+        }
+
+        // Every pass reads what the previous one wrote, which GL only orders with a barrier
+        if (glfwGetProcAddress) memoryBarrier = (void (*)(unsigned int))glfwGetProcAddress("glMemoryBarrier");
+        if (!memoryBarrier) {
+            TraceLog(LOG_WARNING, "FLOCK: glMemoryBarrier not found, using the CPU simulation");
+            unload();
+            return false;
+        }
+        paramsBuffer = rlLoadShaderBuffer(sizeof(GpuParams), nullptr, RL_DYNAMIC_COPY);
+        TraceLog(LOG_INFO, "FLOCK: GPU compute backend ready");
+        return true;
     }
 
-    // Alignment behavior: steer towards the average velocity of nearby boids
-    Vector2 align(std::vector<Boid>& boids) {
-        Vector2 sum = { 0.0f, 0.0f };  // Sum of the velocities of nearby boids
-        int count = 0;
+    // (Re)create the buffers and upload a flock and its parameters
+    void load(const BoidSoA& boids, const SimConfig& config) {
+        unloadBuffers();
 
-        // Loop through all boids and check their distance to the current boid
-        for (auto& other : boids) {
-            float d = Vector2Distance(position, other.position);
-            if (d > 0 && d < NEIGHBOR_RADIUS) {  // If the boid is within the neighbor radius
-                sum = Vector2Add(sum, other.velocity);  // Add the other boid's velocity to the sum
-                count++;
-            }
+        SpatialGrid grid(config.neighborRadius, (float)config.screenWidth, (float)config.screenHeight);  // Same cells as the CPU path
+        params.boidCount = (unsigned int)boids.size();
+        params.cols = grid.cols;
+        params.rows = grid.rows;
+        params.cellWidth = grid.cellWidth;
+        params.cellHeight = grid.cellHeight;
+        params.width = (float)config.screenWidth;
+        params.height = (float)config.screenHeight;
+        params.maxSpeed = config.maxSpeed;
+        params.maxForce = config.maxForce;
+        params.neighborRadius = config.neighborRadius;
+        params.separationRadius = config.separationRadius;
+        params.cohesionWeight = config.cohesionWeight;
+        params.alignmentWeight = config.alignmentWeight;
+        params.separationWeight = config.separationWeight;
+        params.stepScale = config.stepScale();
+        rlUpdateShaderBuffer(paramsBuffer, &params, sizeof(params), 0);
+
+        std::vector<float> state(boids.size() * 4);
+        for (size_t i = 0; i < boids.size(); i++) {
+            state[4 * i] = boids.px[i];
+            state[4 * i + 1] = boids.py[i];
+            state[4 * i + 2] = boids.vx[i];
+            state[4 * i + 3] = boids.vy[i];
         }
+        unsigned int stateBytes = (unsigned int)std::max<size_t>(state.size() * sizeof(float), 16);
+        unsigned int cellCount = (unsigned int)(params.cols * params.rows);
+        stateBuffers[0] = rlLoadShaderBuffer(stateBytes, state.empty() ? nullptr : state.data(), RL_DYNAMIC_COPY);
+        stateBuffers[1] = rlLoadShaderBuffer(stateBytes, nullptr, RL_DYNAMIC_COPY);
+        sortedBuffer = rlLoadShaderBuffer(stateBytes, nullptr, RL_DYNAMIC_COPY);
+        cellCountBuffer = rlLoadShaderBuffer(cellCount * sizeof(unsigned int), nullptr, RL_DYNAMIC_COPY);
+        cellStartBuffer = rlLoadShaderBuffer((cellCount + 1) * sizeof(unsigned int), nullptr, RL_DYNAMIC_COPY);
+        boidSlotBuffer = rlLoadShaderBuffer((unsigned int)std::max<size_t>(boids.size(), 1) * 2 * sizeof(unsigned int), nullptr, RL_DYNAMIC_COPY);
+        current = 0;
+    }
 
-        // If there are nearby boids, average the velocities
-        if (count > 0) {
-            sum = Vector2Scale(sum, 1.0f / (float)count);  // Average the velocities
-            sum = Vector2Normalize(sum);  // Normalize the average velocity
-            sum = Vector2Scale(sum, MAX_SPEED);  // Scale to the maximum speed
-            Vector2 steer = Vector2Subtract(sum, velocity);  // Steer towards the average velocity
-            if (Vector2Length(steer) > MAX_FORCE) {
-                steer = Vector2Scale(Vector2Normalize(steer), MAX_FORCE);  // Limit the steering force
-            }
-            return steer;  // Return the alignment steering force
+    // Run one compute pass over count items and wait for its writes before the next pass
+    void dispatch(unsigned int program, unsigned int count, unsigned int groupSize) {
+        rlEnableShader(program);
+        rlComputeShaderDispatch((count + groupSize - 1) / groupSize, 1, 1);
+        rlDisableShader();
+        memoryBarrier(0x00002000);  // GL_SHADER_STORAGE_BARRIER_BIT
+    }
+
+    // Advance the flock by one frame on the GPU
+    void step() {
+        if (!ready() || params.boidCount == 0) return;
+
+        rlBindShaderBuffer(stateBuffers[current], 0);
+        rlBindShaderBuffer(stateBuffers[1 - current], 1);
+        rlBindShaderBuffer(sortedBuffer, 2);
+        rlBindShaderBuffer(cellCountBuffer, 3);
+        rlBindShaderBuffer(cellStartBuffer, 4);
+        rlBindShaderBuffer(boidSlotBuffer, 5);
+        rlBindShaderBuffer(paramsBuffer, 6);
+
+        unsigned int cellCount = (unsigned int)(params.cols * params.rows);
+        dispatch(clearProgram, cellCount, 256);
+        dispatch(countProgram, params.boidCount, 256);
+        dispatch(scanProgram, 1, 1);  // A single work group
+        dispatch(scatterProgram, params.boidCount, 256);
+        dispatch(stepProgram, params.boidCount, 256);
+
+        current = 1 - current;  // Frame N+1 becomes the current frame
+    }
+
+    // Storage buffer holding the current frame, for drawing
+    unsigned int stateBuffer() const { return stateBuffers[current]; }
+    int boidCount() const { return (int)params.boidCount; }
+
+    // Copy the current frame back into a host flock
+    void download(BoidSoA& boids) const {
+        std::vector<float> state(params.boidCount * 4);
+        if (!state.empty()) rlReadShaderBuffer(stateBuffers[current], state.data(), (unsigned int)(state.size() * sizeof(float)), 0);
+        boids.resize(params.boidCount);
+        for (size_t i = 0; i < boids.size(); i++) {
+            Vector2 velocity = { state[4 * i + 2], state[4 * i + 3] };
+            boids.set(i, Boid({ state[4 * i], state[4 * i + 1] }, velocity, Boid::headingOf(Vector2Normalize(velocity))));
         }
+    }
 
-        return { 0.0f, 0.0f };  // No steering force if no nearby boids
+    void unloadBuffers() {
+        for (unsigned int* buffer : { &stateBuffers[0], &stateBuffers[1], &sortedBuffer, &cellCountBuffer, &cellStartBuffer, &boidSlotBuffer }) {
+            if (*buffer) rlUnloadShaderBuffer(*buffer);
+            *buffer = 0;
+        }
     }
 
-    // Cohesion behavior: steer towards the average position of nearby boids
-    Vector2 cohesion(std::vector<Boid>& boids) {
-        Vector2 sum = { 0.0f, 0.0f };  // Sum of the positions of nearby boids
-        int count = 0;
+    void unload() {
+        unloadBuffers();
+        if (paramsBuffer) rlUnloadShaderBuffer(paramsBuffer);
+        paramsBuffer = 0;
+        for (unsigned int* program : { &clearProgram, &countProgram, &scanProgram, &scatterProgram, &stepProgram }) {
+            if (*program) rlUnloadShaderProgram(*program);
+            *program = 0;
+        }
+    }
+};
 
-        // Loop through all boids and check their distance to the current boid
-        for (auto& other : boids) {
-            float d = Vector2Distance(position, other.position);
-            if (d > 0 && d < NEIGHBOR_RADIUS) {  // If the boid is within the neighbor radius
-                sum = Vector2Add(sum, other.position);  // Add the other boid's position to the sum
-                count++;
+// Live parameter editor: TAB picks a parameter, LEFT/RIGHT change it by 10%
+struct ConfigEditor {
+    int selected = 0;  // Index into CONFIG_FIELDS (only live fields are selectable)
+
+    // Handle the editing keys, returns true if the config was changed
+    bool update(SimConfig& config) {
+        const int fieldCount = (int)(sizeof(CONFIG_FIELDS) / sizeof(CONFIG_FIELDS[0]));
+        if (IsKeyPressed(KEY_TAB)) {
+            do {
+                selected = (selected + 1) % fieldCount;
+            } while (!CONFIG_FIELDS[selected].live);
+        }
+        if (!CONFIG_FIELDS[selected].live) {
+            selected = 0;
+            while (!CONFIG_FIELDS[selected].live) selected++;
+        }
+
+        float factor = IsKeyPressed(KEY_RIGHT) ? 1.1f : IsKeyPressed(KEY_LEFT) ? 1.0f / 1.1f : 1.0f;
+        if (factor == 1.0f) return false;
+
+        const ConfigField& field = CONFIG_FIELDS[selected];
+        if (field.floatValue) {
+            config.*field.floatValue *= factor;
+        } else {
+            int& value = config.*field.intValue;
+            int changed = (int)lroundf(value * factor);
+            if (changed == value) changed += factor > 1.0f ? 1 : -1;  // Small values still move
+            value = std::max(changed, 0);
+        }
+        config.sanitize();
+        return true;
+    }
+
+    void draw(const SimConfig& config) const {
+        const ConfigField& field = CONFIG_FIELDS[selected];
+        const char* value = field.floatValue ? TextFormat("%.3f", config.*field.floatValue) : TextFormat("%d", config.*field.intValue);
+        DrawText(TextFormat("%s = %s   (TAB: next parameter, LEFT/RIGHT: change)", field.key, value), 10, 10, 20, DARKGRAY);
+    }
+};
+
+// Pan and zoom of the window's view of the world: the mouse wheel zooms around the cursor,
+// dragging with the middle button pans and HOME fits the world back into the window.
+// Boids are culled with a SpatialGrid of the drawn frame, so only the boids of the cells
+// in view are submitted and the draw cost follows the visible boids. Zoomed out past
+// heatmap_zoom, where a boid would be a pixel or less, the cells in view are drawn as a
+// density heatmap instead.
+struct CameraView {
+    static constexpr float BOID_LENGTH = 10.0f;  // How far from its position a boid is drawn (see Boid::drawAt)
+
+    Camera2D camera = {};
+    SpatialGrid cells;                    // Grid of the drawn frame, for culling and the heatmap
+    Vector2 cellsWorld;                   // World size and
+    float cellsRadius;                    // neighbor radius the grid was made for
+    AlignedVector<float> px, py, hx, hy;  // Boids of the visible cells
+    size_t drawnBoids = 0;                // Boids submitted in the last frame
+    bool heatmap = false;                 // The last frame was drawn as a heatmap
+
+    explicit CameraView(const SimConfig& config)
+        : cells(config.neighborRadius, (float)config.screenWidth, (float)config.screenHeight),
+          cellsWorld{ (float)config.screenWidth, (float)config.screenHeight }, cellsRadius(config.neighborRadius) {
+        fit(config);
+    }
+
+    // Zoom so that the whole world fills the window, centered
+    void fit(const SimConfig& config) {
+        camera.offset = { GetScreenWidth() * 0.5f, GetScreenHeight() * 0.5f };
+        camera.target = { config.screenWidth * 0.5f, config.screenHeight * 0.5f };
+        camera.rotation = 0.0f;
+        camera.zoom = std::min(GetScreenWidth() / (float)config.screenWidth, GetScreenHeight() / (float)config.screenHeight);
+    }
+
+    // Handle the pan and zoom input
+    void update(const SimConfig& config) {
+        float wheel = GetMouseWheelMove();
+        if (wheel != 0.0f) {
+            Vector2 mouse = GetMousePosition();
+            camera.target = GetScreenToWorld2D(mouse, camera);  // The world point under the cursor stays put
+            camera.offset = mouse;
+            camera.zoom = std::min(std::max(camera.zoom * powf(1.1f, wheel), 0.01f), 32.0f);
+        }
+        if (IsMouseButtonDown(MOUSE_BUTTON_MIDDLE)) {
+            camera.target = Vector2Subtract(camera.target, Vector2Scale(GetMouseDelta(), 1.0f / camera.zoom));
+        }
+        if (IsKeyPressed(KEY_HOME)) fit(config);
+    }
+
+    // Part of the world the window shows
+    Rectangle visibleWorld() const {
+        Vector2 topLeft = GetScreenToWorld2D({ 0.0f, 0.0f }, camera);
+        Vector2 bottomRight = GetScreenToWorld2D({ (float)GetScreenWidth(), (float)GetScreenHeight() }, camera);
+        return { topLeft.x, topLeft.y, bottomRight.x - topLeft.x, bottomRight.y - topLeft.y };
+    }
+
+    // World position under a point of the window
+    Vector2 toWorld(Vector2 screenPosition) const {
+        return GetScreenToWorld2D(screenPosition, camera);
+    }
+
+    // Block of cells [x0, x1] x [y0, y1]
+    struct CellBlock {
+        int x0, x1, y0, y1;
+    };
+
+    // Sort the boids into the cells and find the block of cells a view of the world touches,
+    // returns false if the view is off the world
+    bool cull(const BoidSoA& boids, const SimConfig& config, Rectangle view, CellBlock& block) {
+        const float margin = BOID_LENGTH;  // A boid is drawn up to its length away from its position
+        if (view.x > config.screenWidth + margin || view.y > config.screenHeight + margin ||
+            view.x + view.width < -margin || view.y + view.height < -margin) return false;
+
+        if (cellsWorld.x != config.screenWidth || cellsWorld.y != config.screenHeight || cellsRadius != config.neighborRadius) {
+            cells = SpatialGrid(config.neighborRadius, (float)config.screenWidth, (float)config.screenHeight);
+            cellsWorld = { (float)config.screenWidth, (float)config.screenHeight };
+            cellsRadius = config.neighborRadius;
+        }
+        cells.buildFrom(boids.size(), [&](size_t i) { return Vector2{ boids.px[i], boids.py[i] }; });
+
+        block.x0 = cells.cellColumn(view.x - margin);
+        block.x1 = cells.cellColumn(view.x + view.width + margin);
+        block.y0 = cells.cellRow(view.y - margin);
+        block.y1 = cells.cellRow(view.y + view.height + margin);
+        return true;
+    }
+
+    // Copy the boids of a block of cells into px, py, hx and hy
+    void gather(const BoidSoA& boids, const CellBlock& block) {
+        px.clear();
+        py.clear();
+        hx.clear();
+        hy.clear();
+        for (int y = block.y0; y <= block.y1; y++) {
+            // The cells of a row are stored back to back, so each row of the block is one range
+            for (int e = cells.cellStart[y * cells.cols + block.x0]; e < cells.cellStart[y * cells.cols + block.x1 + 1]; e++) {
+                int i = cells.cellEntries[e];
+                px.push_back(boids.px[i]);
+                py.push_back(boids.py[i]);
+                hx.push_back(boids.hx[i]);
+                hy.push_back(boids.hy[i]);
             }
         }
+    }
 
-        // If there are nearby boids, average the positions
-        if (count > 0) {
-            sum = Vector2Scale(sum, 1.0f / (float)count);  // Average the positions
-            Vector2 steer = Vector2Subtract(sum, position);  // Steer towards the average position
-            steer = Vector2Normalize(steer);  // Normalize the steering vector
-            steer = Vector2Scale(steer, MAX_SPEED);  // Scale to maximum speed
-            steer = Vector2Subtract(steer, velocity);  // Subtract the current velocity to get the required force
-            if (Vector2Length(steer) > MAX_FORCE) {
-                steer = Vector2Scale(Vector2Normalize(steer), MAX_FORCE);  // Limit the force to MAX_FORCE
+    // Draw the boids of the cells in view, or their heatmap (between BeginMode2D and EndMode2D)
+    void draw(BoidRenderer& renderer, const BoidSoA& boids, const SimConfig& config, Color color) {
+        Rectangle view = visibleWorld();
+        heatmap = camera.zoom < config.heatmapZoom;
+        bool wholeWorld = view.x <= -BOID_LENGTH && view.y <= -BOID_LENGTH && view.x + view.width >= config.screenWidth + BOID_LENGTH &&
+                          view.y + view.height >= config.screenHeight + BOID_LENGTH;
+        if (wholeWorld && !heatmap) {  // Nothing to cull
+            renderer.draw(boids, color);
+            drawnBoids = boids.size();
+            return;
+        }
+        drawnBoids = 0;
+        CellBlock block;
+        if (!cull(boids, config, view, block)) return;
+        int x0 = block.x0, x1 = block.x1, y0 = block.y0, y1 = block.y1;
+
+        if (heatmap) {
+            int densest = 1;
+            for (int y = y0; y <= y1; y++) {
+                for (int x = x0; x <= x1; x++) densest = std::max(densest, cells.cellStart[y * cells.cols + x + 1] - cells.cellStart[y * cells.cols + x]);
             }
-            return steer;  // Return the cohesion steering force
+            for (int y = y0; y <= y1; y++) {
+                for (int x = x0; x <= x1; x++) {
+                    int count = cells.cellStart[y * cells.cols + x + 1] - cells.cellStart[y * cells.cols + x];
+                    if (count == 0) continue;
+                    Rectangle cell = { x * cells.cellWidth, y * cells.cellHeight, cells.cellWidth, cells.cellHeight };
+                    DrawRectangleRec(cell, Fade(color, 0.1f + 0.9f * (float)count / (float)densest));
+                }
+            }
+            return;
         }
 
-        return { 0.0f, 0.0f };  // No steering force if no nearby boids
+        gather(boids, block);
+        renderer.draw(px.data(), py.data(), hx.data(), hy.data(), px.size(), color);
+        drawnBoids = px.size();
     }
 
-    // Draw the boid on the screen as a triangle (representing the boid)
-    void draw() {
-        Vector2 front = { position.x + cos(rotation) * 10, position.y + sin(rotation) * 10 };  // Front of the boid
-        Vector2 left = { position.x + cos(rotation + (float)PI / 3) * 6, position.y + sin(rotation + (float)PI / 3) * 6 };  // Left wing
-        Vector2 right = { position.x + cos(rotation - (float)PI / 3) * 6, position.y + sin(rotation - (float)PI / 3) * 6 };  // Right wing
+    // Draw the border of the world, so a zoomed-out view shows where it ends
+    void drawWorldBorder(const SimConfig& config) const {
+        DrawRectangleLinesEx({ 0.0f, 0.0f, (float)config.screenWidth, (float)config.screenHeight }, 1.0f / camera.zoom, LIGHTGRAY);
+    }
+};
 
-        // Draw the boid using three triangles (body + two wings)
-        DrawTriangle(position, front, left, BLUE);
-        DrawTriangle(position, front, right, BLUE);
+// Mouse edits of the flock: the left button spawns boids at the cursor, the right
+// button removes the ones near it (like a predator eating them)
+FlockEdit mouseEdit(const CameraView& view) {
+    FlockEdit edit = { view.toWorld(GetMousePosition()), 0, 0.0f };
+    if (IsMouseButtonDown(MOUSE_BUTTON_LEFT)) edit.spawnCount = 20;
+    if (IsMouseButtonDown(MOUSE_BUTTON_RIGHT)) edit.removeRadius = 40.0f;
+    return edit;
+}
+
+// Play a recording back in a window at the simulation rate it was recorded with.
+// SPACE pauses, and playback starts over after the last frame.
+int runReplay(const char* path) {
+    FrameReplay replay;
+    if (!replay.open(path) || replay.frameCount() == 0) return 1;
+    const SimConfig& config = replay.config;
+
+    InitWindow(config.screenWidth, config.screenHeight, "Boid Flocking Simulation (replay)");
+    BoidRenderer renderer;
+    renderer.init();
+    SetTargetFPS(config.targetFps);
+
+    BoidSoA decoded;            // Quantized frames are expanded into this
+    double playhead = 0.0;      // Position in the recording, in frames
+    bool paused = false;
+    while (!WindowShouldClose()) {
+        if (IsKeyPressed(KEY_SPACE)) paused = !paused;
+        if (!paused) playhead = fmod(playhead + GetFrameTime() * config.simRate, (double)replay.frameCount());
+        FrameReplay::Frame frame = replay.frame((size_t)playhead);
+
+        BeginDrawing();
+        ClearBackground(RAYWHITE);
+        if (replay.quantized) {
+            replay.decode(frame, decoded);
+            renderer.draw(decoded, BLUE);
+        } else {
+            renderer.draw(frame.px, frame.py, frame.hx, frame.hy, frame.boidCount, BLUE);  // Straight from the mapping
+        }
+        DrawText(TextFormat("Step %llu  (%zu / %zu)%s", (unsigned long long)frame.step, (size_t)playhead + 1, replay.frameCount(), paused ? "  paused" : ""), 10, 10, 20, DARKGRAY);
+        EndDrawing();
+    }
+
+    renderer.unload();
+    CloseWindow();
+    return 0;
+}
+
+// A flock for the microbenchmarks: count boids spread uniformly over the world, or
+// gathered in a few clumps four neighbor radii across. Either way the boids are stored
+// in grid cell order, as Simulation::reorder keeps them.
+BoidSoA microbenchFlock(const SimConfig& config, int count, bool clumped) {
+    Pcg32 rng((uint64_t)config.seed);
+    const int clumps = 16;
+    Vector2 centers[clumps];
+    for (Vector2& center : centers) center = { (float)rng.range(0, config.screenWidth), (float)rng.range(0, config.screenHeight) };
+
+    BoidSoA unsorted;
+    unsorted.reserve(count);
+    for (int i = 0; i < count; i++) {
+        Vector2 position = { (float)rng.range(0, config.screenWidth), (float)rng.range(0, config.screenHeight) };
+        if (clumped) {
+            // Sum of two uniform offsets: denser towards the center of the clump
+            float spread = config.neighborRadius;
+            Vector2 center = centers[rng.range(0, clumps - 1)];
+            position.x = fmodf(center.x + (rng.range(-1000, 1000) + rng.range(-1000, 1000)) * 0.001f * spread + config.screenWidth, (float)config.screenWidth);
+            position.y = fmodf(center.y + (rng.range(-1000, 1000) + rng.range(-1000, 1000)) * 0.001f * spread + config.screenHeight, (float)config.screenHeight);
+        }
+        unsorted.push_back(Boid(position, rng));
+    }
+
+    SpatialGrid grid(config.neighborRadius, (float)config.screenWidth, (float)config.screenHeight, config.gridSubdivision);
+    grid.build(unsorted);
+    BoidSoA flock;
+    flock.gather(unsorted, grid.cellEntries);
+    return flock;
+}
+
+// Seed of the microbenchmark flocks unless --seed is given, so that runs time the same flocks
+const int MICROBENCH_SEED = 1;
+
+// What an earlier microbenchmark run was measured on; results are only comparable if it matches
+struct MicrobenchSetup {
+    std::string kernel;
+    int seed = 0;
+    int screenWidth = 0, screenHeight = 0;
+};
+
+// One result of an earlier microbenchmark run
+struct MicrobenchResult {
+    std::string key;   // See makeKey()
+    double medianMs;
+
+    static std::string makeKey(const std::string& name, int boids, int radius, const char* distribution) {
+        return name + "/" + std::to_string(boids) + "/" + std::to_string(radius) + "/" + distribution;
     }
 };
 
+// Read the results of a file written by runMicrobench (one result per line)
+bool loadMicrobenchResults(const char* path, MicrobenchSetup& setup, std::vector<MicrobenchResult>& results) {
+    std::ifstream in(path);
+    if (!in) return false;
+    std::string line;
+    while (std::getline(in, line)) {
+        char kernel[16];
+        if (sscanf(line.c_str(), "{\"kernel\":\"%15[^\"]\",\"seed\":%d,\"screen_width\":%d,\"screen_height\":%d",
+                   kernel, &setup.seed, &setup.screenWidth, &setup.screenHeight) == 4) {
+            setup.kernel = kernel;
+            continue;
+        }
+        char name[64], distribution[16];
+        int boids, radius;
+        double medianMs;
+        if (sscanf(line.c_str(), ",{\"name\":\"%63[^\"]\",\"boids\":%d,\"radius\":%d,\"distribution\":\"%15[^\"]\",\"runs\":%*d,\"median_ms\":%lf",
+                   name, &boids, &radius, distribution, &medianMs) == 5 ||
+            sscanf(line.c_str(), "{\"name\":\"%63[^\"]\",\"boids\":%d,\"radius\":%d,\"distribution\":\"%15[^\"]\",\"runs\":%*d,\"median_ms\":%lf",
+                   name, &boids, &radius, distribution, &medianMs) == 5) {
+            results.push_back({ MicrobenchResult::makeKey(name, boids, radius, distribution), medianMs });
+        }
+    }
+    return true;
+}
+
+// Time each hot piece of a step and of a frame on its own, on one thread, for every
+// flock size, neighbor radius and distribution (uniform or clumped), and write the
+// results to a JSON file so that runs can be compared. Each benchmark is repeated for
+// at least minSeconds (and three times), and its median time is reported. With a
+// baseline file from an earlier run, returns 1 if any benchmark got slower than its
+// baseline by more than REGRESSION_TOLERANCE.
+int runMicrobench(const SimConfig& baseConfig, const std::vector<int>& boidCounts, const std::vector<int>& radii, double minSeconds,
+                  const char* path, const char* baselinePath) {
+    const double REGRESSION_TOLERANCE = 0.15;  // Above the run-to-run noise of a quiet machine
+    NeighborKernelInfo simd = detectNeighborKernel<FlockBehaviors::terms>();
+    MicrobenchSetup baselineSetup;
+    std::vector<MicrobenchResult> baseline;
+    if (baselinePath && !loadMicrobenchResults(baselinePath, baselineSetup, baseline)) {
+        fprintf(stderr, "Could not read %s\n", baselinePath);
+        return 1;
+    }
+    if (baselinePath && (baselineSetup.kernel != simd.name || baselineSetup.seed != baseConfig.seed ||
+                         baselineSetup.screenWidth != baseConfig.screenWidth || baselineSetup.screenHeight != baseConfig.screenHeight)) {
+        fprintf(stderr, "%s was measured with kernel %s, seed %d and a %dx%d world; this run has kernel %s, seed %d and a %dx%d world, so they can't be compared\n",
+                baselinePath, baselineSetup.kernel.c_str(), baselineSetup.seed, baselineSetup.screenWidth, baselineSetup.screenHeight,
+                simd.name, baseConfig.seed, baseConfig.screenWidth, baseConfig.screenHeight);
+        return 1;
+    }
+    FILE* file = fopen(path, "w");
+    if (!file) {
+        fprintf(stderr, "Could not write %s\n", path);
+        return 1;
+    }
+    NeighborKernelInfo scalar = { "scalar", accumulateNeighborsScalar<FlockBehaviors::terms>, accumulateListScalar<FlockBehaviors::terms>,
+                                  accumulateCompactScalar<FlockBehaviors::terms> };
+    fprintf(file, "{\"kernel\":\"%s\",\"seed\":%d,\"screen_width\":%d,\"screen_height\":%d,\"min_seconds\":%g,\"results\":[\n",
+            simd.name, baseConfig.seed, baseConfig.screenWidth, baseConfig.screenHeight, minSeconds);
+    printf("%-24s %10s %8s %10s %8s %12s %12s %10s\n", "benchmark", "boids", "radius", "flock", "runs", "median ms", "ns/boid", baseline.empty() ? "" : "vs base");
+
+    bool first = true;
+    int regressions = 0;
+    auto report = [&](const std::string& name, int boidCount, int radius, const char* flockName, std::vector<double>& times) {
+        std::sort(times.begin(), times.end());
+        double median = times[times.size() / 2];
+        std::string key = MicrobenchResult::makeKey(name, boidCount, radius, flockName);
+        const MicrobenchResult* base = nullptr;
+        for (const MicrobenchResult& result : baseline) {
+            if (result.key == key) base = &result;
+        }
+        double change = base ? median * 1e3 / base->medianMs - 1.0 : 0.0;
+        bool regressed = base && change > REGRESSION_TOLERANCE;
+        if (regressed) regressions++;
+
+        printf("%-24s %10d %8d %10s %8zu %12.4f %12.2f %10s%s\n", name.c_str(), boidCount, radius, flockName, times.size(), median * 1e3, median * 1e9 / boidCount,
+            base ? TextFormat("%+.1f%%", change * 100.0) : "", regressed ? " REGRESSED" : "");
+        fprintf(file, "%s{\"name\":\"%s\",\"boids\":%d,\"radius\":%d,\"distribution\":\"%s\",\"runs\":%zu,\"median_ms\":%.6f,\"min_ms\":%.6f,\"ns_per_boid\":%.4f",
+                first ? "" : ",\n", name.c_str(), boidCount, radius, flockName, times.size(), median * 1e3, times.front() * 1e3, median * 1e9 / boidCount);
+        if (base) fprintf(file, ",\"baseline_ms\":%.6f,\"regressed\":%s", base->medianMs, regressed ? "true" : "false");
+        fprintf(file, "}");
+        first = false;
+        fflush(stdout);
+    };
+    auto measure = [&](auto&& body) {
+        body();  // Warm the caches and the allocations
+        std::vector<double> times;
+        double total = 0.0;
+        while (times.size() < 3 || total < minSeconds) {
+            auto start = std::chrono::steady_clock::now();
+            body();
+            times.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+            total += times.back();
+        }
+        return times;
+    };
+
+    float sink = 0.0f;  // Results are summed into it, so the compiler can't drop the work
+    for (int boidCount : boidCounts) {
+        for (int radius : radii) {
+            for (bool clumped : { false, true }) {
+                SimConfig config = baseConfig;
+                config.numBoids = boidCount;
+                config.neighborRadius = (float)radius;
+                config.sanitize();
+                const char* flockName = clumped ? "clumped" : "uniform";
+                BoidSoA flock = microbenchFlock(config, boidCount, clumped);
+                SpatialGrid grid(config.neighborRadius, (float)config.screenWidth, (float)config.screenHeight, config.gridSubdivision);
+                grid.setAggregateRadii(config.neighborRadius, config.separationRadius);
+                grid.build(flock);
+
+                // The original per-behavior neighbor loops (separate, align, cohesion), with their own grid
+                std::vector<Boid> boids;
+                for (size_t i = 0; i < flock.size(); i++) boids.push_back(flock.get(i));
+                SpatialGrid boidGrid(config.neighborRadius, (float)config.screenWidth, (float)config.screenHeight);
+                boidGrid.build(boids);
+                std::vector<double> times = measure([&] {
+                    for (const Boid& boid : boids) {
+                        Vector2 force = Vector2Add(Vector2Add(boid.separate(boids, boidGrid, config), boid.align(boids, boidGrid, config)), boid.cohesion(boids, boidGrid, config));
+                        sink += force.x;
+                    }
+                });
+                report("separate_align_cohesion", boidCount, radius, flockName, times);
+
+                times = measure([&] { grid.build(flock); });
+                report("grid_build", boidCount, radius, flockName, times);
+
+                // The fused neighbor pass, with the scalar kernel and the one this CPU runs
+                for (const NeighborKernelInfo* kernel : { &scalar, &simd }) {
+                    if (kernel == &simd && strcmp(simd.name, scalar.name) == 0) break;
+                    times = measure([&] {
+                        for (size_t i = 0; i < flock.size(); i++) sink += flock.get(i).flock(grid, *kernel, config).x;
+                    });
+                    report(std::string("fused_") + kernel->name, boidCount, radius, flockName, times);
+                }
+
+                // Integration of a step: update plus borders, storing the result like stepRange
+                BoidSoA next = flock;
+                times = measure([&] {
+                    for (size_t i = 0; i < flock.size(); i++) {
+                        Boid boid = flock.get(i);
+                        boid.applyForce({ 0.01f, -0.01f });
+                        boid.update(config);
+                        boid.borders(config);
+                        next.set(i, boid);
+                    }
+                });
+                report("update_borders", boidCount, radius, flockName, times);
+
+                // The host side of a frame: interpolating the flock, culling it to a view of
+                // a quarter of the world and gathering the visible boids (the instanced draw
+                // itself needs a window)
+                CameraView view(config);
+                BoidSoA drawState;
+                Rectangle quarter = { config.screenWidth * 0.25f, config.screenHeight * 0.25f, config.screenWidth * 0.5f, config.screenHeight * 0.5f };
+                times = measure([&] {
+                    interpolateFlock(flock, next, 0.5f, config, drawState);
+                    CameraView::CellBlock block;
+                    if (view.cull(drawState, config, quarter, block)) view.gather(drawState, block);
+                    sink += (float)view.px.size();
+                });
+                report("render_batch", boidCount, radius, flockName, times);
+            }
+        }
+    }
+    fprintf(file, "\n]}\n");
+    if (sink == 12345.0f) printf("\n");  // Keeps sink alive
+    if (fclose(file) != 0) {
+        fprintf(stderr, "Could not write %s\n", path);
+        return 1;
+    }
+    printf("Wrote %s\n", path);
+    if (regressions > 0) {
+        printf("%d benchmarks are more than %.0f%% slower than %s\n", regressions, REGRESSION_TOLERANCE * 100.0, baselinePath);
+        return 1;
+    }
+    return 0;
+}
+
 // Main program loop
-int main() {
-    InitWindow(screenWidth, screenHeight, "Boid Flocking Simulation");  // Initialize the window
+int main(int argc, char** argv) {
+    // Command line: --headless runs the benchmark instead of opening a window,
+    // --config loads a parameter file and --<parameter> <value> overrides single parameters
+    SimConfig config;
+    bool headless = false;
+    bool useGpu = false;
+    bool pipelined = false;
+    const char* tracePath = nullptr;
+    const char* recordPath = nullptr;
+    const char* replayPath = nullptr;
+    const char* microbenchPath = nullptr;
+    const char* baselinePath = nullptr;
+    std::vector<int> radii;
+    double benchSeconds = 0.2;
+    bool recordQuantized = false;
+    bool validate = false;
+    bool distributed = false;
+    std::vector<int> boidCounts;
+    int steps = 1000;
+    int warmupSteps = 100;
+    for (int i = 1; i < argc; i++) {
+        bool hasValue = i + 1 < argc;
+        if (strcmp(argv[i], "--headless") == 0) headless = true;
+        else if (strcmp(argv[i], "--gpu") == 0) useGpu = true;
+        else if (strcmp(argv[i], "--pipelined") == 0) pipelined = true;
+        else if (strcmp(argv[i], "--validate") == 0) validate = true;
+        else if (strcmp(argv[i], "--distributed") == 0) distributed = true;
+        else if (strcmp(argv[i], "--trace") == 0 && hasValue) tracePath = argv[++i];
+        else if (strcmp(argv[i], "--record") == 0 && hasValue) recordPath = argv[++i];
+        else if (strcmp(argv[i], "--record-quantized") == 0) recordQuantized = true;
+        else if (strcmp(argv[i], "--replay") == 0 && hasValue) replayPath = argv[++i];
+        else if (strcmp(argv[i], "--microbench") == 0 && hasValue) microbenchPath = argv[++i];
+        else if (strcmp(argv[i], "--radii") == 0 && hasValue) radii = parseIntList(argv[++i]);
+        else if (strcmp(argv[i], "--baseline") == 0 && hasValue) baselinePath = argv[++i];
+        else if (strcmp(argv[i], "--bench-time") == 0 && hasValue) benchSeconds = std::max(0.0, atof(argv[++i]));
+        else if (strcmp(argv[i], "--config") == 0 && hasValue) config.loadFile(argv[++i]);
+        else if (strcmp(argv[i], "--boids") == 0 && hasValue) boidCounts = parseIntList(argv[++i]);
+        else if (strcmp(argv[i], "--steps") == 0 && hasValue) steps = std::max(1, atoi(argv[++i]));
+        else if (strcmp(argv[i], "--warmup") == 0 && hasValue) warmupSteps = std::max(0, atoi(argv[++i]));
+        else if (strncmp(argv[i], "--", 2) == 0 && hasValue && config.set(argv[i] + 2, argv[i + 1])) i++;
+        else {
+            fprintf(stderr, "Usage: %s [--headless] [--distributed] [--gpu] [--pipelined] [--validate] [--trace file.json] [--config file.ini|file.json] [--<parameter> value]...\n"
+                            "          [--boids N[,N...]] [--steps K] [--warmup K] [--record file.flock [--record-quantized]] [--replay file.flock]\n"
+                            "          [--microbench results.json [--radii R[,R...]] [--bench-time seconds] [--baseline earlier.json]]\n", argv[0]);
+            return 1;
+        }
+    }
+    config.sanitize();
+    if (config.seed == 0) config.seed = microbenchPath ? MICROBENCH_SEED : clockSeed();  // Chosen once, so every flock of the run (and a recording) shares it
+    if (boidCounts.empty()) boidCounts.push_back(config.numBoids);
+    profiler().tracing = tracePath != nullptr;
+    if (replayPath) return runReplay(replayPath);
+    if (microbenchPath) {
+        SetTraceLogLevel(LOG_WARNING);
+        if (radii.empty()) radii.push_back((int)config.neighborRadius);
+        return runMicrobench(config, boidCounts, radii, benchSeconds, microbenchPath, baselinePath);
+    }
+
+    FrameRecorder recorder;  // Optional recording of every simulation step
+    if (recordPath && !recorder.open(recordPath, config, recordQuantized)) return 1;
+
+    if (distributed) {
+        SetTraceLogLevel(LOG_WARNING);
+        return runDistributed(config, boidCounts[0], steps, warmupSteps);
+    }
+
+    if (headless) {
+        SetTraceLogLevel(LOG_WARNING);  // Keep the report readable
+        printf("seed %d\n", config.seed);
+        if (validate) return runValidation(config, boidCounts, steps);
+        int result = runHeadless(config, boidCounts, steps, warmupSteps, recorder.isOpen() ? &recorder : nullptr);
+        if (!recorder.close()) result = 1;
+        if (tracePath && !profiler().writeTrace(tracePath)) fprintf(stderr, "Could not write %s\n", tracePath);
+        return result;
+    }
 
-    // Create a vector of boids with random initial positions
-    std::vector<Boid> boids;
-    for (int i = 0; i < NUM_BOIDS; i++) {
-        boids.push_back(Boid({ (float)GetRandomValue(0, screenWidth), (float)GetRandomValue(0, screenHeight) }));
+    InitWindow(config.windowWidth > 0 ? config.windowWidth : config.screenWidth,
+               config.windowHeight > 0 ? config.windowHeight : config.screenHeight, "Boid Flocking Simulation");  // Initialize the window
+
+    config.numBoids = boidCounts[0];
+    Simulation simulation(config);  // Flock with random initial positions
+    ConfigEditor editor;            // Live parameter editing
+    CameraView view(config);        // Pan, zoom and culling
+    BoidRenderer renderer;          // Instanced boid drawing
+    renderer.init();
+
+    // Optional GPU backend, started from the same initial flock
+    GpuSimulation gpu;
+    if (useGpu && renderer.initStorageShader() && gpu.init()) {
+        gpu.load(simulation.current, simulation.config);
     }
+    if (recorder.isOpen()) {
+        if (gpu.ready()) TraceLog(LOG_WARNING, "FLOCK: --record is ignored with the GPU backend");
+        else simulation.recorder = &recorder;
+    }
+
+    // Optional simulation thread, pipelined with drawing (the GPU backend steps on this thread)
+    SimulationThread simulationThread(simulation);
+    if (pipelined && gpu.ready()) TraceLog(LOG_WARNING, "FLOCK: --pipelined is ignored with the GPU backend");
+    pipelined = pipelined && !gpu.ready();
+    if (pipelined) simulationThread.start();
 
-    SetTargetFPS(60);  // Set the game to run at 60 frames per second
+    // Optional step-by-step check of the backend against the scalar reference
+    if (pipelined && validate) TraceLog(LOG_WARNING, "FLOCK: --validate is ignored with --pipelined");
+    std::unique_ptr<StepValidator> validator;
+    if (validate && !pipelined) validator = std::make_unique<StepValidator>(simulation.config);
+
+    SetTargetFPS(config.targetFps);  // Cap the render rate; the simulation rate is separate
+
+    BoidSoA drawState;         // Flock interpolated between the last two simulation steps
+    double accumulator = 0.0;  // Real time not simulated yet, in seconds
+    bool showProfiler = false; // F1 toggles the phase timing overlay
 
     // Main game loop
     while (!WindowShouldClose()) {
-        // Apply the flocking behaviors (separation, alignment, cohesion) to each boid
-        for (auto& boid : boids) {
-            Vector2 sep = boid.separate(boids);  // Separation force
-            Vector2 ali = boid.align(boids);     // Alignment force
-            Vector2 coh = boid.cohesion(boids);  // Cohesion force
+        if (IsKeyPressed(KEY_F1)) showProfiler = !showProfiler;
+        view.update(config);
+
+        FlockEdit edit = mouseEdit(view);
+        bool hasEdit = edit.spawnCount > 0 || edit.removeRadius > 0;
+
+        if (pipelined) {
+            config.numBoids = simulationThread.latest().config.numBoids;  // Follow spawns and removals
+            if (hasEdit) simulationThread.edit(edit);
+            simulationThread.setLodView(view.visibleWorld());  // Boids out of view may coast longer (lod_interval)
+            if (editor.update(config)) {
+                simulationThread.setConfig(config);  // Applied at the next step boundary
+                SetTargetFPS(config.targetFps);
+            }
+
+            // Draw the latest finished frames while the simulation thread computes the next ones
+            const FlockSnapshot& snapshot = simulationThread.latest();
+            double alpha = (monotonicSeconds() - snapshot.time) * snapshot.config.simRate;
+            interpolateFlock(snapshot.previous, snapshot.current, (float)std::min(std::max(alpha, 0.0), 1.0), snapshot.config, drawState);
+
+            BeginDrawing();
+            ClearBackground(RAYWHITE);
+            {
+                PROFILE_SCOPE(PHASE_DRAW);
+                BeginMode2D(view.camera);
+                view.drawWorldBorder(config);
+                view.draw(renderer, drawState, snapshot.config, BLUE);
+                EndMode2D();
+                editor.draw(config);
+                if (showProfiler) profiler().draw(10, 40);
+            }
+            {
+                PROFILE_SCOPE(PHASE_PRESENT);
+                EndDrawing();
+            }
+            PROFILE_FRAME();  // Simulation phases count towards the frame they finished in
+            continue;
+        }
 
-            // Scale the forces by their respective weights
-            sep = Vector2Scale(sep, SEPARATION_WEIGHT);
-            ali = Vector2Scale(ali, ALIGNMENT_WEIGHT);
-            coh = Vector2Scale(coh, COHESION_WEIGHT);
+        if (editor.update(config)) {
+            if (gpu.ready()) gpu.download(simulation.current);  // Resize and reseed from the GPU state
+            simulation.setConfig(config);  // Apply edited parameters before the next step
+            if (gpu.ready()) gpu.load(simulation.current, simulation.config);
+            SetTargetFPS(config.targetFps);
+        }
+        if (hasEdit && !gpu.ready()) {
+            simulation.applyEdit(edit);
+            config.numBoids = simulation.config.numBoids;
+        }
 
-            // Apply the forces to the boid
-            boid.applyForce(sep);
-            boid.applyForce(ali);
-            boid.applyForce(coh);
+        // Boids out of view may coast longer (lod_interval); the reference has to see the same view
+        simulation.lodView = view.visibleWorld();
+        if (validator) validator->reference.lodView = simulation.lodView;
 
-            boid.update();    // Update boid's position and velocity
-            boid.borders();   // Ensure boid wraps around the screen edges
+        // Run as many fixed simulation steps as the elapsed time calls for
+        double dt = 1.0 / config.simRate;
+        accumulator += GetFrameTime();
+        int stepsThisFrame = 0;
+        while (accumulator >= dt && stepsThisFrame < config.maxStepsPerFrame) {
+            // Apply the flocking behaviors and move every boid
+            if (validator && gpu.ready()) {
+                // The GPU has no reordering, neighbor caps, cell sums, LOD or compact layout, so neither has its reference
+                SimConfig gpuConfig = config;
+                gpuConfig.reorderInterval = 0;
+                gpuConfig.lodInterval = 1;
+                gpuConfig.maxNeighborsPerCell = 0;
+                gpuConfig.cellAggregates = 0;
+                gpuConfig.compactNeighbors = 0;
+                gpu.download(validator->actual);
+                validator->expect(validator->actual, simulation.arena, 0, 0, gpuConfig);
+                gpu.step();
+                gpu.download(validator->actual);
+                validator->check(validator->actual);
+            } else if (validator) {
+                validator->expect(simulation.current, simulation.arena, simulation.stepsSinceReorder, simulation.stepCount, config);
+                simulation.step();
+                validator->check(simulation.current);
+            } else if (gpu.ready()) {
+                gpu.step();
+            } else {
+                simulation.step();
+            }
+            accumulator -= dt;
+            stepsThisFrame++;
         }
+        if (accumulator >= dt) accumulator = fmod(accumulator, dt);  // Too far behind: drop the backlog instead of spiraling
 
         // Drawing section
         BeginDrawing();
         ClearBackground(RAYWHITE);  // Clear the screen
 
-        // Draw all boids on the screen
-        for (auto& boid : boids) {
-            boid.draw();
-        }
+        {
+            PROFILE_SCOPE(PHASE_DRAW);
+
+            // Draw the boids in view
+            BeginMode2D(view.camera);
+            view.drawWorldBorder(config);
+            if (gpu.ready()) {
+                // Latest GPU step, not interpolated. The boids stay on the GPU, so they aren't culled
+                // here; the ones out of view are clipped after the vertex shader.
+                renderer.drawStorage(gpu.stateBuffer(), gpu.boidCount(), BLUE);
+            } else {
+                simulation.interpolate((float)(accumulator / dt), drawState);
+                view.draw(renderer, drawState, config, BLUE);
+            }
+            EndMode2D();
 
-        EndDrawing();  // End drawing
+            editor.draw(config);
+            if (!gpu.ready()) {
+                const char* shown = view.heatmap ? TextFormat("density of %zu boids", drawState.size()) : TextFormat("%zu of %zu boids drawn", view.drawnBoids, drawState.size());
+                DrawText(TextFormat("zoom %.2f: %s   (wheel: zoom, middle button: pan, HOME: fit)", view.camera.zoom, shown), 10, GetScreenHeight() - 55, 20, DARKGRAY);
+            }
+            if (showProfiler) profiler().draw(10, 40);
+            if (validator) {
+                DrawText(TextFormat("validate: %llu steps, %llu exact, %llu boids mismatched, max error %.2g", (unsigned long long)validator->steps, (unsigned long long)validator->exactSteps,
+                    (unsigned long long)validator->mismatchedBoids, std::max(validator->maxPositionError, validator->maxVelocityError)), 10, GetScreenHeight() - 30, 20, validator->passed() ? DARKGREEN : RED);
+            }
+        }
+        {
+            PROFILE_SCOPE(PHASE_PRESENT);
+            EndDrawing();  // End drawing
+        }
+        PROFILE_FRAME();
     }
 
+    simulationThread.stop();
+    recorder.close();
+    if (tracePath && !profiler().writeTrace(tracePath)) TraceLog(LOG_WARNING, "FLOCK: Could not write %s", tracePath);
+    gpu.unload();
+    renderer.unload();
     CloseWindow();  // Close the window
     return 0;
 }